@@ -8,8 +8,23 @@
 #include "../memory/idt.h"
 
 void InitInterrupts(uint8_t mask1, uint8_t mask2);
+void LoadInterruptTable();
+
+// SYSENTER, if the CPU has it (see syscall.cpp)
+void InitFastSyscalls();
+void EnableFastSyscalls();
+bool AreFastSyscallsEnabled();
 
 inline void EnableInterrupts()  { asm volatile("sti"); }
 inline void DisableInterrupts() { asm volatile("cli"); }
 
+// For kernel code that may be preempted, but has a section that mustn't be
+inline uint32_t SaveAndDisableInterrupts()
+{
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+inline void RestoreInterrupts(uint32_t flags) { if (flags & 0x200) asm volatile("sti" : : : "memory"); }
+
 #endif
\ No newline at end of file
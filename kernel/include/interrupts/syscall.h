@@ -11,10 +11,37 @@
 
 #include "../file/filedefs.h"
 
-#define SYSCALL_ARGS_0(type, fn, num) inline type fn() { int a; asm volatile("int $0x80" : "=a" (a) : "0" (num)); return (type) a; }
-#define SYSCALL_ARGS_1(type, fn, num, p1, n1) inline type fn(p1 n1) { int a; asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((unsigned int)n1)); return (type) a; }
-#define SYSCALL_ARGS_2(type, fn, num, p1, n1, p2, n2) inline type fn(p1 n1, p2 n2) { int a; asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((unsigned int)n1), "c" ((unsigned int)n2)); return (type) a; }
-#define SYSCALL_ARGS_3(type, fn, num, p1, n1, p2, n2, p3, n3) inline type fn(p1 n1, p2 n2, p3 n3) { int a; asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((unsigned int)n1), "c" ((unsigned int)n2), "d" ((unsigned int)n3)); return (type) a; }
+// Always inlined, so each call site is just the trap, as with a bare int 0x80
+#define SYSCALL_INLINE static inline __attribute__((always_inline))
+
+// SYSENTER when the kernel has set it up for this thread, else int 0x80. Arguments go in
+// ebx, ecx and edx either way, and the kernel returns with sysexit to the esp we leave in
+// ebp and eip in edi, trashing ecx and edx
+SYSCALL_INLINE int Syscall(uint32_t num, uint32_t b, uint32_t c, uint32_t d)
+{
+    int a;
+    asm volatile("cmpl $0, %%gs:%c[fast]\n\t"
+                 "je 1f\n\t"
+                 "push %%ebp\n\t"
+                 "mov %%esp, %%ebp\n\t"
+                 "mov $2f, %%edi\n\t"
+                 "sysenter\n"
+                 "2:\n\t"
+                 "pop %%ebp\n\t"
+                 "jmp 3f\n"
+                 "1:\n\t"
+                 "int $0x80\n"
+                 "3:"
+                 : "=a" (a), "+c" (c), "+d" (d)
+                 : "0" (num), "b" (b), [fast] "i" (TLS_SYSENTER * 4)
+                 : "edi", "memory", "cc");
+    return a;
+}
+
+#define SYSCALL_ARGS_0(type, fn, num) SYSCALL_INLINE type fn() { return (type) Syscall(num, 0, 0, 0); }
+#define SYSCALL_ARGS_1(type, fn, num, p1, n1) SYSCALL_INLINE type fn(p1 n1) { return (type) Syscall(num, (unsigned int)n1, 0, 0); }
+#define SYSCALL_ARGS_2(type, fn, num, p1, n1, p2, n2) SYSCALL_INLINE type fn(p1 n1, p2 n2) { return (type) Syscall(num, (unsigned int)n1, (unsigned int)n2, 0); }
+#define SYSCALL_ARGS_3(type, fn, num, p1, n1, p2, n2, p3, n3) SYSCALL_INLINE type fn(p1 n1, p2 n2, p3 n3) { return (type) Syscall(num, (unsigned int)n1, (unsigned int)n2, (unsigned int)n3); }
 
 
 SYSCALL_ARGS_1(int, printf, 0, char const*, message)
@@ -50,11 +77,42 @@ SYSCALL_ARGS_1(int, kill, 29, uint32_t, processID)
 SYSCALL_ARGS_0(int, getFirstFile, 30)
 SYSCALL_ARGS_1(int, getGDT, 31, void*, data)
 SYSCALL_ARGS_0(uint32_t, nTotalPages, 32)
+SYSCALL_ARGS_3(int, threadCreate, 33, uint32_t, entry, uint32_t, arg0, uint32_t, arg1)
+SYSCALL_ARGS_1(int, threadJoin, 34, uint32_t, threadID)
+SYSCALL_ARGS_1(int, threadExit, 35, int, exitCode)
+SYSCALL_ARGS_2(int, getTaskStats, 36, TaskStats*, stats, uint32_t, maxTasks)
+SYSCALL_ARGS_2(int, setChildCPUQuota, 37, uint32_t, quota, uint32_t, period)
+SYSCALL_ARGS_3(int, setDeadline, 38, uint32_t, runtime, uint32_t, period, uint32_t, deadline)
+SYSCALL_ARGS_0(int, yieldPeriod, 39)
+SYSCALL_ARGS_1(int, exit, 40, int, exitCode)
+SYSCALL_ARGS_2(int, wait, 41, uint32_t, processID, int*, status)
+SYSCALL_ARGS_3(int, getEvents, 42, TaskEvent*, events, uint32_t, maxEvents, uint32_t, timeout)
+SYSCALL_ARGS_2(int, writeStdout, 43, const char*, data, uint32_t, length)
+SYSCALL_ARGS_3(int, readStdout, 44, uint32_t, processID, char*, buffer, uint32_t, size)
+SYSCALL_ARGS_1(int, pipe, 45, uint32_t*, ends)
+SYSCALL_ARGS_1(int, pipeClose, 46, uint32_t, end)
+SYSCALL_ARGS_3(int, pipeRead, 47, uint32_t, end, void*, buffer, uint32_t, size)
+SYSCALL_ARGS_3(int, pipeWrite, 48, uint32_t, end, const void*, data, uint32_t, length)
+SYSCALL_ARGS_3(int, loadProgramWithPipes, 49, const char*, sName, uint32_t, stdinEnd, uint32_t, stdoutEnd)
+SYSCALL_ARGS_3(uint32_t, waitEvents, 50, const uint32_t*, ids, uint32_t, count, uint32_t, timeout)
+SYSCALL_ARGS_2(int, ipcSend, 51, uint32_t, processID, const IPCMessage*, message)
+SYSCALL_ARGS_2(int, ipcCall, 52, uint32_t, processID, IPCMessage*, message)
+SYSCALL_ARGS_1(int, ipcReceive, 53, IPCMessage*, message)
+SYSCALL_ARGS_2(int, ipcReply, 54, uint32_t, processID, const IPCMessage*, message)
+SYSCALL_ARGS_2(int, ipcReplyReceive, 55, uint32_t, processID, IPCMessage*, message)
+SYSCALL_ARGS_3(int, futexWait, 56, uint32_t*, address, uint32_t, expected, uint32_t, timeout)
+SYSCALL_ARGS_2(int, futexWake, 57, uint32_t*, address, uint32_t, nWaiters)
+SYSCALL_ARGS_1(int, shmCreate, 58, uint32_t, size)
+SYSCALL_ARGS_1(void*, shmMap, 59, uint32_t, handle)
+SYSCALL_ARGS_1(int, shmUnmap, 60, uint32_t, handle)
+SYSCALL_ARGS_1(int, focusKeyboard, 61, uint32_t, processID)
+SYSCALL_ARGS_0(SyscallRing*, ringSetup, 62)
+SYSCALL_ARGS_0(int, ringEnter, 63)
 
 #ifdef __cplusplus 
 extern "C"
 {
-    int HandleSyscalls(Registers syscall);
+    int HandleSyscalls(Registers* syscall);
 }
 #endif
 
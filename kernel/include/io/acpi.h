@@ -0,0 +1,63 @@
+#pragma once
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ACPI_MAX_CPUS 16
+
+struct RSDP
+{
+    char signature[8];      // "RSD PTR "
+    uint8_t checksum;
+    char oemID[6];
+    uint8_t revision;
+    uint32_t rsdtAddress;
+} __attribute__((packed));
+
+struct SDTHeader
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oemID[6];
+    char oemTableID[8];
+    uint32_t oemRevision;
+    uint32_t creatorID;
+    uint32_t creatorRevision;
+} __attribute__((packed));
+
+struct MADT
+{
+    SDTHeader header;
+    uint32_t localAPICAddress;
+    uint32_t flags;
+    // Followed by variable length entries
+} __attribute__((packed));
+
+#define MADT_ENTRY_LOCAL_APIC   0
+#define MADT_CPU_ENABLED        (1 << 0)
+#define MADT_CPU_ONLINE_CAPABLE (1 << 1)
+
+struct MADTLocalAPIC
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t processorID;
+    uint8_t apicID;
+    uint32_t flags;
+} __attribute__((packed));
+
+// What SMP bring-up needs out of the MADT
+struct CPUTopology
+{
+    uint32_t localAPICAddress;
+    uint32_t nCPUs;
+    uint8_t apicIDs[ACPI_MAX_CPUS];
+};
+
+bool GetCPUTopology(CPUTopology* pTopology);
+
+#endif
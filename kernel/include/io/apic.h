@@ -0,0 +1,50 @@
+#pragma once
+#ifndef APIC_H
+#define APIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Local APIC registers, as offsets from its base
+#define APIC_ID                 0x20
+#define APIC_EOI                0xB0
+#define APIC_SPURIOUS           0xF0
+#define APIC_ICR_LOW            0x300
+#define APIC_ICR_HIGH           0x310
+#define APIC_LVT_TIMER          0x320
+#define APIC_TIMER_INITIAL      0x380
+#define APIC_TIMER_CURRENT      0x390
+#define APIC_TIMER_DIVIDE       0x3E0
+
+#define APIC_SOFTWARE_ENABLE    (1 << 8)
+#define APIC_LVT_MASKED         (1 << 16)
+#define APIC_TIMER_PERIODIC     (1 << 17)
+#define APIC_TIMER_DIVIDE_16    0x3
+
+#define APIC_ICR_FIXED          0x00004000  // asserted, edge triggered
+#define APIC_ICR_INIT           0x00004500
+#define APIC_ICR_STARTUP        0x00004600
+#define APIC_ICR_PENDING        (1 << 12)
+#define APIC_ICR_ALL_BUT_SELF   (3 << 18)
+
+// Vectors, clear of the remapped PIC's 0x20 - 0x2F
+#define APIC_TIMER_VECTOR       0x30
+#define APIC_RESCHEDULE_VECTOR  0x31
+#define APIC_TLB_FLUSH_VECTOR   0x32
+#define APIC_SPURIOUS_VECTOR    0xFF
+
+void InitLocalAPIC(uint32_t address);
+void EnableLocalAPIC();
+uint32_t GetLocalAPICID();
+void LocalAPICEndInterrupt();
+
+void CalibrateLocalAPICTimer();
+void StartLocalAPICTimer();
+void LocalAPICDelay(uint32_t microseconds);
+
+void SendInitIPI(uint32_t apicID);
+void SendStartupIPI(uint32_t apicID, uint8_t page);
+void SendIPI(uint32_t apicID, uint8_t vector);
+void BroadcastIPI(uint8_t vector);
+
+#endif
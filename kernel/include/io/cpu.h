@@ -2,10 +2,42 @@
 #ifndef SSE_H
 #define SSE_E
 
+#include <stdint.h>
+
+// XCR0 state components
+#define XCR0_X87    (1 << 0)
+#define XCR0_SSE    (1 << 1)
+#define XCR0_AVX    (1 << 2)
+
+// Where SYSENTER finds the kernel
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
 extern "C"
 {
     bool IsSSESupported();
     void EnableSSE();
+
+    bool IsXSAVESupported();
+    bool IsXSAVEOPTSupported();
+    bool IsAVXSupported();
+    uint32_t GetXSAVEAreaSize();
+    void EnableXSAVE(uint32_t features);
+
+    void FXSaveState(void* pState);
+    void FXRestoreState(void* pState);
+    void XSaveState(void* pState);
+    void XSaveOptState(void* pState);
+    void XRestoreState(void* pState);
+
+    bool IsSYSENTERSupported();
+    void WriteMSR(uint32_t msr, uint32_t low, uint32_t high);
+
+    void SetTaskSwitched();
+    void ClearTaskSwitched();
+
+    uint64_t ReadTimestampCounter();
 }
 
 #endif
\ No newline at end of file
@@ -71,7 +71,23 @@ inline constexpr uint64_t CreateGDTEntry(const uint32_t base, const uint32_t lim
 
 void PrintGDT(const uint64_t* pTable, const unsigned int nEntries);
 
-extern uint64_t GDTTable[6];
+#define GDT_TSS_ENTRY    5
+#define GDT_TSS_SELECTOR (GDT_TSS_ENTRY * 8 | 0b11)
+
+// User data segment whose base is moved to the running thread's TLS block
+#define GDT_TLS_ENTRY    6
+#define GDT_TLS_SELECTOR (GDT_TLS_ENTRY * 8 | 0b11)
+
+// Kernel data segment whose base is the CPU's own data (see smp.h)
+#define GDT_CPU_ENTRY    7
+#define GDT_CPU_SELECTOR (GDT_CPU_ENTRY * 8)
+
+#define GDT_ENTRIES      8
+
+void SetThreadLocalStorage(const uint32_t base);
+
+// The BSP's - each other CPU has a copy with its own TSS, TLS and CPU entries
+extern uint64_t GDTTable[GDT_ENTRIES];
 
 extern "C"
 {
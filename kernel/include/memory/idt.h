@@ -81,6 +81,8 @@ extern "C"
     extern void LoadIDT(const IDTDescriptor* IDTDescriptor);
     void HandleInterrupts(uint32_t irq, uint32_t unknown);
     void HandleExceptions(uint32_t irq, uint32_t eip, uint32_t errorCode, Registers regs);
+    void HandleDeviceNotAvailable();
+    void HandleAPICInterrupts(uint32_t vector);
     void SanityCheck(uint32_t eip);
 
     extern void IRQ0();
@@ -132,14 +134,17 @@ extern "C"
     extern void IRQException29();
     extern void IRQException30();
 
+    extern void IRQDeviceNotAvailable();
+
+    extern void IRQLocalTimer();
+    extern void IRQReschedule();
+    extern void IRQFlushTLB();
+    extern void IRQSpurious();
+
     extern void IRQSyscall80();
+    extern void IRQSysenter();
 
     extern void IRQUnknown();
 }
 
-extern volatile bool bIRQShouldJump;
-extern volatile uint32_t IRQReturnAddress;
-extern volatile uint32_t IRQJumpEIP;
-extern volatile bool bSysexitCall;
-
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <stddef.h>
 
 #include "../multiboot.h"
+#include "../multitask/lock.h"
 #include "mmu.h"
 
 extern uint32_t __kernel_end;
@@ -53,6 +54,15 @@ void DeallocatePage(uint32_t physicalAddress);
 void AllocatePageDirectory(uint32_t physicalAddress, uint32_t virtualAddress, uint32_t flags,  bool kernel);
 void DeallocatePageDirectory(uint32_t physicalAddress, uint32_t flags);
 
+// Where user programs are mapped - private to each CPU (see smp.h)
+#define USER_WINDOW_ADDRESS     0x40000000
+#define USER_WINDOW_DIRECTORIES 4
+
+uint32_t* CreatePageDirectory(uint32_t** ppUserWindow);
+void MapUserWindow(uint32_t* pUserWindow, uint32_t location, uint32_t nPages, uint32_t nOldPages);
+
+extern KernelLock kmallocLock;
+
 void* kmalloc(uint32_t bytes, uint32_t flags = KERNEL_PAGE, bool kernel = true);
 void  kfree(void* ptr, uint32_t bytes);
 
@@ -0,0 +1,19 @@
+#pragma once
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FXSAVE_AREA_SIZE 512
+
+void InitFPU();
+void EnableFPU();
+
+uint8_t* CreateFPUState();
+void FreeFPUState(uint8_t* pState);
+
+void SaveFPUState(uint8_t* pState);
+void RestoreFPUState(uint8_t* pState);
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Guards kernel state that may be touched by code the scheduler
+    can preempt. Waiting yields to other tasks rather than spinning,
+    as the holder may have been preempted and must run to release it.
+*/
+struct KernelLock
+{
+    volatile bool bLocked = false;
+};
+
+void AcquireLock(KernelLock* lock);
+void ReleaseLock(KernelLock* lock);
+
+inline bool IsLocked(KernelLock* lock) { return lock->bLocked; }
+
+/*
+    Guards state shared between CPUs for a handful of instructions.
+    Only ever held with interrupts off, so the holder is always
+    running on some other CPU and waiting can just spin.
+*/
+struct SpinLock
+{
+    volatile bool bLocked = false;
+};
+
+inline void AcquireSpinLock(SpinLock* lock)
+{
+    while (__atomic_exchange_n(&lock->bLocked, true, __ATOMIC_ACQUIRE))
+    {
+        while (lock->bLocked) asm volatile("pause");
+    }
+}
+
+inline void ReleaseSpinLock(SpinLock* lock)
+{
+    __atomic_store_n(&lock->bLocked, false, __ATOMIC_RELEASE);
+}
+
+#endif
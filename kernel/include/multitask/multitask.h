@@ -6,77 +6,290 @@
 #include <stddef.h>
 
 #include "task.h"
+#include "smp.h"
 
-#define MAX_TASK_EVENTS 47  // 2020 bytes
+#define KERNEL_STACK_SIZE 8192
 
-struct TaskEventQueue
+#define PROCESS_TABLE_SIZE 64       // buckets, for both process IDs and names
+#define MAX_PROCESS_ID 0xFFFF       // then wraps around, reusing IDs no longer in use
+
+#define MAX_DEADLINE_UTILISATION 95 // percent of every CPU that deadline tasks may reserve
+
+#define CONTROL_EVENT_SLOTS 16      // of each event queue, that only the kernel's own events may fill
+
+#define STDOUT_BUFFER_SIZE 16384    // bytes a process may write ahead of its reader, power of two
+#define STDOUT_RECHECK_TICKS 12     // how often a blocked writer checks its reader is still there
+
+#define FUTEX_BUCKETS 64            // wait queues, hashed by physical address
+
+#define MAX_PIPE_ENDS 16            // per process, counting stdin and stdout
+
+#define MAX_SHARED_REGIONS 64       // in the whole system
+#define MAX_SHARED_MAPPINGS 16      // per process
+
+// Descendants of the process that created it share its CPU quota, which is
+// charged a tick at a time along with any group it's nested in (see SetChildCPUQuota)
+struct TaskGroup
+{
+    TaskGroup* pParent;
+    uint32_t quota;         // ticks per period, summed over all CPUs, or 0 if unlimited
+    uint32_t period;        // ticks
+    uint32_t used;          // ticks this period
+    uint32_t periodEnd;     // tick the next period starts on
+    uint32_t nThrottled;    // periods that ran out of quota
+    uint32_t nReferences;   // member tasks, nested groups and the process owning it
+};
+
+// Bytes a process has written to stdout, but its reader - the nearest ancestor
+// subscribed to stdout - hasn't read yet. It's sent one event whenever there's
+// something new, and reads until it's empty (see ReadStdout)
+struct Stream
+{
+    char* pBuffer;          // STDOUT_BUFFER_SIZE bytes
+    uint32_t head;          // next to read, counting up forever
+    uint32_t tail;          // next to write
+    bool bNotified;         // reader has been sent an event since it last emptied it
+};
+
+// A stream any number of processes may hold ends of - readers and writers block
+// on it, rather than being sent events, and see EOF and broken pipes once all the
+// other side's ends are closed
+struct Pipe
+{
+    Stream stream;                          // with a buffer as big as stdout's
+    uint32_t nReaders;                      // ends held open
+    uint32_t nWriters;
+};
+
+struct PipeEnd
+{
+    Pipe* pPipe;                            // or nullptr if closed
+    bool bWrite;
+};
+
+// User pages any number of processes may have mapped at once, found by handle,
+// and freed once the last of them unmaps it (see MapSharedRegion)
+struct SharedRegion
+{
+    uint32_t address;                       // or 0 if the slot is free
+    uint32_t size;                          // bytes, a multiple of PAGE_SIZE
+    uint32_t nReferences;                   // processes with it mapped
+    uint32_t generation;                    // bumped whenever the slot's freed, so stale handles miss
+};
+
+static_assert((STDOUT_BUFFER_SIZE & (STDOUT_BUFFER_SIZE - 1)) == 0, "Stdout buffer must be a power of two");
+static_assert((MAX_TASK_EVENTS & (MAX_TASK_EVENTS - 1)) == 0, "Event queue must be a power of two");
+static_assert(CONTROL_EVENT_SLOTS < MAX_TASK_EVENTS, "Bulk events need some of the queue too");
+static_assert((SYSCALL_RING_ENTRIES & (SYSCALL_RING_ENTRIES - 1)) == 0, "Syscall ring must be a power of two");
+static_assert(MAX_TASK_EVENTS <= sizeof(TaskEventQueue::removed) * 8, "Event queue needs a removed bit per slot");
+
+// Kernel events tasks subscribe to, each with a list of its subscribers
+enum Topic
+{
+    TOPIC_STDOUT,           // of descendants, read by the nearest subscribed ancestor
+    TOPIC_SYSEXIT,          // of descendants, sent to every subscribed ancestor
+    TOPIC_KEYBOARD,         // sent only to whichever subscriber has focus
+    N_TOPICS
+};
+
+enum IPCState
+{
+    IPC_IDLE,
+    IPC_SENDING,            // queued on the receiver until it takes the message
+    IPC_RECEIVING,          // until anything sends to us
+    IPC_AWAITING_REPLY      // having called, until the receiver replies
+};
+
+enum TaskType
 {
-    TaskEvent returnEventBuffer;
-    uint32_t nEvents = 0;
-    TaskEvent events[MAX_TASK_EVENTS];
-} __attribute__((packed));
+    KERNEL_TASK,
+    USER_TASK
+};
 
 struct Task
 {
     char sName[32];
+    TaskType type;
     uint32_t processID;
     uint32_t size;
     uint32_t location;
-    uint32_t* pStack;
-    uint32_t* pOriginalStack;
+    uint32_t* pOriginalStack;       // user stack (user tasks only)
+    uint32_t* pKernelStack;         // saved by SwitchContext
+    uint32_t* pOriginalKernelStack;
+    uint8_t* pFPUState;             // fxsave or XSAVE area, only saved on demand (user tasks only)
+    uint32_t* pThreadLocalStorage;  // gs base - first word points back at itself (user tasks only)
+    Task* pProcess = nullptr;       // main thread, which owns size and location
+    uint32_t nThreads = 0;          // not yet reaped, counting itself - the last frees size and location (main thread only)
     Task* pPrevTask = nullptr;
     Task* pNextTask = nullptr;
+    Task* pNextWithID = nullptr;    // same bucket of the process table
+    Task* pNextWithName = nullptr;  // same bucket of the name index (processes only)
+    bool bNameIndexed = false;
+    CPU* pCPU = nullptr;            // last ran on, and whose run queue it joins
+    Task* pPrevQueued = nullptr;
+    Task* pNextQueued = nullptr;
+    bool bQueued = false;
+    bool bRunning = false;
     TaskEventQueue* pEventQueue = nullptr;
-    bool bSubscribeToStdout = false;
-    bool bSubscribeToSysexit = false;
-    bool bSubscribeToKeyboard = false;
+    uint32_t eventHead = 0;         // its queue's, as far as we've seen it consume...
+    uint32_t eventTail = 0;         // ...and push - the task can write anything to the page itself
+    uint32_t eventGrants[MAX_TASK_EVENTS];      // given with the event in each slot until it's consumed, or 0...
+    uint32_t eventGrantSizes[MAX_TASK_EVENTS];  // ...so only these are ever freed, never what's in the page
+    SyscallRing* pSyscallRing = nullptr;    // once it's asked for one (see ringSetup)
+    bool bSubscribed[N_TOPICS];
+    Task* pNextSubscriber[N_TOPICS];    // in each topic's list, if subscribed to it
+    Stream* pStdout = nullptr;          // written by all its threads, once there's been a write (main thread only)
+    Stream* pWaitingForStream = nullptr; // blocked writing, until the reader makes room, or on a pipe
+    PipeEnd pipeEnds[MAX_PIPE_ENDS];    // indexed by handle, starting with PIPE_STDIN and PIPE_STDOUT (main thread only)
+    uint32_t sharedMappings[MAX_SHARED_MAPPINGS]; // handles of shared regions mapped, or 0 (main thread only)
     uint32_t parentID = 0;
     bool bBlocked = false;
     uint32_t blockedEvent = 0;
+    uint32_t waitIDs[MAX_WAIT_EVENTS];  // any one of which wakes us, if there are any (see WaitEvents)
+    uint32_t nWaitIDs = 0;
+    bool bExited = false;
+    bool bPreemptible = false;      // inside a syscall that runs with interrupts on
+    bool bKillPending = false;
+    bool bZombie = false;           // exited thread waiting to be joined, or process waited for
+    bool bMainThread = false;       // leaves a zombie behind for its parent to wait for
+    bool bReleased = false;         // zombie with nothing left but this struct
+    uint32_t nReferences = 0;       // lookups still using it (see GetTaskWithProcessID)
+    bool bUnreferenced = false;     // unlinked and done with, so the last ReleaseTask frees it
+    bool bWaitingForChild = false;
+    uint32_t exitCode = 0;
+    Task* pJoiner = nullptr;        // the only thread that may join it, once one has tried
+    Task* pNextDead = nullptr;      // waiting for the reaper
+    bool bSleeping = false;         // until wakeTick, unless woken sooner
+    uint32_t wakeTick = 0;
+    Task* pNextSleeping = nullptr;
+    // Synchronous IPC, guarded by the scheduler (see IPCCall)
+    IPCState ipcState = IPC_IDLE;
+    uint32_t ipcPartner = 0;        // sending to or awaiting a reply from, else who last sent to us
+    bool bIPCCall = false;          // wants a reply to what it's sending
+    int ipcResult = 0;              // -1 if the partner exited first
+    IPCMessage ipcMessage;          // waiting to be taken, or just delivered
+    Task* pIPCSenders = nullptr;    // blocked sending to us, oldest first
+    Task* pNextIPCSender = nullptr;
+
+    uint32_t futexKey = 0;          // physical address we're waiting on, while queued (see FutexWait)
+    Task* pNextFutexWaiter = nullptr;
+
+    TaskGroup* pGroup = nullptr;        // charged for CPU time, or nullptr if unlimited
+    TaskGroup* pChildGroup = nullptr;   // new child processes join this one instead (main thread only)
+
+    // Earliest deadline first, ahead of round robin, in ticks (see SetDeadline)
+    bool bDeadline = false;
+    bool bJobDone = false;          // this period's, by yielding
+    bool bWaitingForPeriod = false;
+    uint32_t runtime = 0;
+    uint32_t period = 0;
+    uint32_t relativeDeadline = 0;
+    uint32_t remainingRuntime = 0;  // this period, after which it's throttled
+    uint32_t absoluteDeadline = 0;
+    uint32_t nextRelease = 0;
+    uint32_t nDeadlineMisses = 0;
+    Task* pNextDeadline = nullptr;
+
+    // Accounting, in TSC cycles
+    uint64_t runCycles = 0;         // charged on switch-out
+    uint64_t blockedCycles = 0;     // charged on wake
+    uint64_t switchedInAt = 0;
+    uint64_t blockedSince = 0;
+    uint32_t nSwitches = 0;
+    uint32_t nSyscalls = 0;
+    uint32_t nPageFaults = 0;
+    uint32_t nDroppedEvents = 0;    // pushed to a full queue, guarded by eventLock
 };
 
 void EnableScheduler();
 void DisableScheduler();
 
+void Schedule();
 void OnMultitaskPIT();
+void OnRescheduleIPI();
 
 uint32_t GetNumberOfTasks();
 
 void TaskExit(Task* task = nullptr);
 
+void ExitProcess(Task* task = nullptr, uint32_t exitCode = 0);
+
 void TaskGrow(uint32_t size);
 
 TaskEvent* GetNextEvent();
+int GetEvents(TaskEvent* pEvents, uint32_t maxEvents, uint32_t timeout);
+uint32_t WaitEvents(const uint32_t* pIDs, uint32_t nIDs, uint32_t timeout);
 int PushEvent(Task* task, TaskEvent* event, uint32_t processIDSource);
 int PushEvent(Task* task, TaskEvent* event);
+int PushGrantEvent(Task* task, TaskEvent* event);
 int PopLastEvent(uint32_t event);
 
 Task* GetTaskWithProcessID(uint32_t id);
+void ReleaseTask(Task* task);
 
 void SubscribeToStdout(bool subscribe);
 void OnStdout(const char* message);
 void OnStdout(uint32_t number, bool hex);
+int WriteStdout(const char* pData, uint32_t length);
+int ReadStdout(uint32_t processID, char* pBuffer, uint32_t size);
+
+int CreatePipe(uint32_t* pEnds);
+int ClosePipeEnd(uint32_t end);
+bool IsPipeEnd(uint32_t end, bool bWrite);
+int PipeRead(uint32_t end, char* pBuffer, uint32_t size);
+int PipeWrite(uint32_t end, const char* pData, uint32_t length);
+
+int CreateSharedRegion(uint32_t size);
+uint32_t MapSharedRegion(uint32_t handle);
+int UnmapSharedRegion(uint32_t handle);
 
 void SubscribeToSysexit(bool subscribe);
-void OnSysexit(uint32_t exitingProcessID);
-void OnSysexit();
+void OnSysexit(uint32_t exitingProcessID, uint32_t exitCode);
+void OnSysexit(uint32_t exitCode = 0);
 
 void SubscribeToKeyboard(bool subscribe);
+int FocusKeyboard(uint32_t processID);
 void OnKeyEvent(char key, bool bSpecial);
 
 void KillTask(Task* task);
 
 void OnProcessBlock(uint32_t event = 0);
 
+void BeginPreemptibleSection();
+void EndPreemptibleSection();
+
+void OnDeviceNotAvailable();
+
 uint32_t GetProcess(const char* sName);
 
-enum TaskType
-{
-    KERNEL_TASK,
-    USER_TASK
-};
+uint32_t GetTaskStats(TaskStats* pStats, uint32_t maxTasks);
+
+int SetChildCPUQuota(uint32_t quota, uint32_t period);
+
+int WaitForChild(uint32_t processID, int* pStatus);
+
+int IPCSend(uint32_t processID, const IPCMessage* pMessage);
+int IPCCall(uint32_t processID, IPCMessage* pMessage);
+int IPCReceive(IPCMessage* pMessage);
+int IPCReply(uint32_t processID, const IPCMessage* pMessage);
+int IPCReplyReceive(uint32_t processID, IPCMessage* pMessage);
+
+int FutexWait(uint32_t* pAddress, uint32_t expected, uint32_t timeout);
+int FutexWake(uint32_t* pAddress, uint32_t nWaiters);
+
+int SetDeadline(uint32_t runtime, uint32_t period, uint32_t deadline);
+int YieldPeriod();
+
+Task* CreateTask(char const* sName, uint32_t entry, uint32_t size = 0, uint32_t location = 0, uint32_t parentID = 0,
+                 uint32_t stdinEnd = PIPE_NONE, uint32_t stdoutEnd = PIPE_NONE);
+Task* CreateChildTask(char const* sName, uint32_t entry, uint32_t size = 0, uint32_t location = 0,
+                      uint32_t stdinEnd = PIPE_NONE, uint32_t stdoutEnd = PIPE_NONE);
+Task* CreateKernelTask(char const* sName, void (*entry)());
+
+Task* CreateThread(uint32_t entry, uint32_t arg0, uint32_t arg1);
+int JoinThread(Task* thread);
+void ThreadExit(uint32_t exitCode);
 
-Task* CreateTask(char const* sName, uint32_t entry, uint32_t size = 0, uint32_t location = 0, uint32_t parentID = 0);
-Task* CreateChildTask(char const* sName, uint32_t entry, uint32_t size = 0, uint32_t location = 0);
+void InitMultitasking();
 
 #endif
\ No newline at end of file
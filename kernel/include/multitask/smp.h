@@ -0,0 +1,72 @@
+#pragma once
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../memory/tss.h"
+
+#define MAX_CPUS 16
+
+// Where application processors start (see trampoline.S)
+#define TRAMPOLINE_ADDRESS 0x8000
+
+struct Task;
+
+/*
+    Everything the scheduler used to keep in globals, one per CPU.
+    fs points at the running CPU's copy in ring 0 (see GetCPU).
+*/
+struct CPU
+{
+    CPU* pSelf;                     // fs:0
+    Task* pCurrentTask;             // read in one instruction, see GetCurrentTask
+    uint32_t id;
+    uint32_t apicID;
+    volatile bool bOnline;
+
+    uint32_t* pIdleStack;           // where this CPU idles when no task can run
+    Task* pFPUOwner;                // task whose FPU state is loaded here
+
+    // Runnable tasks waiting for this CPU
+    Task* pRunQueueHead;
+    Task* pRunQueueTail;
+    uint32_t nQueued;
+
+    // Each CPU has its own view of 0x40000000
+    uint32_t* pPageDirectory;
+    uint32_t* pUserWindow;
+    Task* pMappedProcess;
+    uint32_t nMappedPages;
+    uint32_t tlbGeneration;         // last TLB shootdown acknowledged (see FlushOtherCPUsTLB)
+
+    uint64_t* pGDT;
+    TSS tss;
+};
+
+extern CPU cpus[MAX_CPUS];
+extern uint32_t nCPUs;
+
+// Only meaningful with interrupts off, else we may move CPU before it's used
+inline CPU* GetCPU()
+{
+    CPU* cpu;
+    asm volatile("mov %%fs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+inline Task* GetCurrentTask()
+{
+    Task* task;
+    asm volatile("mov %%fs:4, %0" : "=r"(task));
+    return task;
+}
+
+void InitBootCPU();
+void InitSMP();
+
+void FlushOtherCPUsTLB();
+void OnTLBFlushIPI();
+
+#endif
@@ -5,13 +5,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
-extern volatile uint32_t oldTaskStack;
-extern volatile uint32_t newTaskStack;
-
 extern "C"
 {
-    extern void PerformTaskSwitch();
-    extern void PerformOneWaySwitch();
+    extern void SwitchContext(uint32_t** ppOldStack, uint32_t* pNewStack);
+    extern void ReturnToUserTask();
+
+    // First thing a new task runs - the scheduler is still locked from switching to it
+    void OnTaskStart();
 }
 
-#endif
\ No newline at end of file
+#endif
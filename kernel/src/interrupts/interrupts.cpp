@@ -2,10 +2,13 @@
 #include "../memory/idt.h"
 #include "../io/pic.h"
 #include "../io/io.h"
+#include "../io/apic.h"
+#include "../memory/paging.h"
 #include "../gfx/vga.h"
 #include "syscall.h"
 #include "timer.h"
 #include "keyboard.h"
+#include "../multitask/multitask.h"
 
 static IDT idt[256];
 
@@ -47,10 +50,24 @@ void InitInterrupts(uint8_t mask1, uint8_t mask2)
     idt[14] =   CreateIDTEntry((uint32_t) IRQException14, 0x8, ENABLED_R0_INTERRUPT);   idt[29] = CreateIDTEntry((uint32_t) IRQException29, 0x8, ENABLED_R0_INTERRUPT);
     idt[30] =   CreateIDTEntry((uint32_t) IRQException30, 0x8, ENABLED_R0_INTERRUPT);
 
+    // Lazy FPU switching
+    idt[7] =    CreateIDTEntry((uint32_t) IRQDeviceNotAvailable, 0x8, ENABLED_R0_INTERRUPT);
+
+    // Local APIC (see InitSMP)
+    idt[APIC_TIMER_VECTOR] =        CreateIDTEntry((uint32_t) IRQLocalTimer, 0x8, ENABLED_R0_INTERRUPT);
+    idt[APIC_RESCHEDULE_VECTOR] =   CreateIDTEntry((uint32_t) IRQReschedule, 0x8, ENABLED_R0_INTERRUPT);
+    idt[APIC_TLB_FLUSH_VECTOR] =    CreateIDTEntry((uint32_t) IRQFlushTLB, 0x8, ENABLED_R0_INTERRUPT);
+    idt[APIC_SPURIOUS_VECTOR] =     CreateIDTEntry((uint32_t) IRQSpurious, 0x8, ENABLED_R0_INTERRUPT);
+
     // Syscalls
     idt[0x80] = CreateIDTEntry((uint32_t) IRQSyscall80, 0x8, ENABLED_R3_INTERRUPT);
 
-    // IDT descriptor
+    LoadInterruptTable();
+}
+
+void LoadInterruptTable()
+{
+    // IDT descriptor - shared by every CPU
     IDTDescriptor descriptor = IDTDescriptor(idt);
 
     // Load IDT and enable interrupts
@@ -66,6 +83,10 @@ void HandleInterrupts(uint32_t irq, uint32_t unknown)
         return;
     }
 
+    // Acknowledge up front, as the timer may switch tasks and
+    // not come back here until this one is next scheduled
+    PIC_EndInterrupt((uint8_t)irq);
+
     switch (irq)
     {
         case 0x0:
@@ -87,12 +108,33 @@ void HandleInterrupts(uint32_t irq, uint32_t unknown)
             while (true) asm("hlt");
         break;
     }
+}
 
-    PIC_EndInterrupt((uint8_t)irq);
+void HandleDeviceNotAvailable()
+{
+    OnDeviceNotAvailable();
+}
+
+void HandleAPICInterrupts(uint32_t vector)
+{
+    LocalAPICEndInterrupt();
+
+    // Another CPU freed pages we may still have cached
+    if (vector == APIC_TLB_FLUSH_VECTOR) OnTLBFlushIPI();
+
+    // Application processors' timer, standing in for the BSP's PIT
+    if (vector == APIC_TIMER_VECTOR) OnMultitaskPIT();
+
+    // Another CPU wanting us to schedule
+    if (vector == APIC_RESCHEDULE_VECTOR) OnRescheduleIPI();
 }
 
 void HandleExceptions(uint32_t irq, uint32_t eip, uint32_t errorCode, Registers regs)
 {
+    // Page faults are still fatal, but charged to whoever caused them
+    Task* task = GetCurrentTask();
+    if (irq == 14 && task != nullptr) task->nPageFaults++;
+
     VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
     VGA_printf("Excecption ", false);
     VGA_printf<uint32_t, true>(irq, false);
@@ -8,42 +8,76 @@
 #include "../gfx/vga.h"
 #include "../interrupts/timer.h"
 #include "../interrupts/keyboard.h"
-
-static int SysPrintf                (Registers syscall);
-static int SysNTasks                (Registers syscall);
-static int SysSysexit               (Registers syscall);
-static int SysNPages                (Registers syscall);
-static int SysPrintn                (Registers syscall);
-static int SysGetFramebufferAddr    (Registers syscall);
-static int SysGetFramebufferWidth   (Registers syscall);
-static int SysGetFramebufferHeight  (Registers syscall);
-static int SysMalloc                (Registers syscall);
-static int SysFree                  (Registers syscall);
-static int SysFileOpen              (Registers syscall);
-static int SysGetFileSize           (Registers syscall);
-static int SysGetFileName           (Registers syscall);
-static int SysFileRead              (Registers syscall);
-static int SysFileClose             (Registers syscall);
-static int SysGetNextFile           (Registers syscall);
-static int SysGetNextEvent          (Registers syscall);
-static int SysPushEvent             (Registers syscall);
-static int SysLoadProgram           (Registers syscall);
-static int SysSubscribeToStdout     (Registers syscall);
-static int SysGetProcess            (Registers syscall);
-static int SysSubscribeToSysexit    (Registers syscall);
-static int SysGetSeconds            (Registers syscall);
-static int SysBlock                 (Registers syscall);
-static int SysPopLastEvent          (Registers syscall);
-static int SysGetKeyBufferAddr      (Registers syscall);
-static int SysSubscribeToKeyboard   (Registers syscall);
-static int SysGetSubseconds         (Registers syscall);
-static int SysBlockUntil            (Registers syscall);
-static int SysKill                  (Registers syscall);
-static int SysGetFirstFile          (Registers syscall);
-static int SysGetGDT                (Registers syscall);
-static int SysNTotalPages           (Registers syscall);
-
-static int (*pSyscalls[])(Registers syscall) =
+#include "../interrupts/interrupts.h"
+#include "../multitask/smp.h"
+#include "../io/cpu.h"
+
+static int SysPrintf                (Registers* syscall);
+static int SysNTasks                (Registers* syscall);
+static int SysSysexit               (Registers* syscall);
+static int SysNPages                (Registers* syscall);
+static int SysPrintn                (Registers* syscall);
+static int SysGetFramebufferAddr    (Registers* syscall);
+static int SysGetFramebufferWidth   (Registers* syscall);
+static int SysGetFramebufferHeight  (Registers* syscall);
+static int SysMalloc                (Registers* syscall);
+static int SysFree                  (Registers* syscall);
+static int SysFileOpen              (Registers* syscall);
+static int SysGetFileSize           (Registers* syscall);
+static int SysGetFileName           (Registers* syscall);
+static int SysFileRead              (Registers* syscall);
+static int SysFileClose             (Registers* syscall);
+static int SysGetNextFile           (Registers* syscall);
+static int SysGetNextEvent          (Registers* syscall);
+static int SysPushEvent             (Registers* syscall);
+static int SysLoadProgram           (Registers* syscall);
+static int SysSubscribeToStdout     (Registers* syscall);
+static int SysGetProcess            (Registers* syscall);
+static int SysSubscribeToSysexit    (Registers* syscall);
+static int SysGetSeconds            (Registers* syscall);
+static int SysBlock                 (Registers* syscall);
+static int SysPopLastEvent          (Registers* syscall);
+static int SysGetKeyBufferAddr      (Registers* syscall);
+static int SysSubscribeToKeyboard   (Registers* syscall);
+static int SysGetSubseconds         (Registers* syscall);
+static int SysBlockUntil            (Registers* syscall);
+static int SysKill                  (Registers* syscall);
+static int SysGetFirstFile          (Registers* syscall);
+static int SysGetGDT                (Registers* syscall);
+static int SysNTotalPages           (Registers* syscall);
+static int SysThreadCreate          (Registers* syscall);
+static int SysThreadJoin            (Registers* syscall);
+static int SysThreadExit            (Registers* syscall);
+static int SysGetTaskStats          (Registers* syscall);
+static int SysSetChildCPUQuota      (Registers* syscall);
+static int SysSetDeadline           (Registers* syscall);
+static int SysYieldPeriod           (Registers* syscall);
+static int SysExit                  (Registers* syscall);
+static int SysWait                  (Registers* syscall);
+static int SysGetEvents             (Registers* syscall);
+static int SysWriteStdout           (Registers* syscall);
+static int SysReadStdout            (Registers* syscall);
+static int SysPipe                  (Registers* syscall);
+static int SysPipeClose             (Registers* syscall);
+static int SysPipeRead              (Registers* syscall);
+static int SysPipeWrite             (Registers* syscall);
+static int SysLoadProgramWithPipes  (Registers* syscall);
+static int SysWaitEvents            (Registers* syscall);
+static int SysIPCSend               (Registers* syscall);
+static int SysIPCCall               (Registers* syscall);
+static int SysIPCReceive            (Registers* syscall);
+static int SysIPCReply              (Registers* syscall);
+static int SysIPCReplyReceive       (Registers* syscall);
+static int SysFutexWait             (Registers* syscall);
+static int SysFutexWake             (Registers* syscall);
+static int SysShmCreate             (Registers* syscall);
+static int SysShmMap                (Registers* syscall);
+static int SysShmUnmap              (Registers* syscall);
+static int SysFocusKeyboard         (Registers* syscall);
+static int SysRingSetup             (Registers* syscall);
+static int SysRingEnter             (Registers* syscall);
+
+static int (*pSyscalls[])(Registers* syscall) =
 {
     &SysPrintf,
     &SysNTasks,
@@ -77,13 +111,44 @@ static int (*pSyscalls[])(Registers syscall) =
     &SysKill,
     &SysGetFirstFile,
     &SysGetGDT,
-    &SysNTotalPages
+    &SysNTotalPages,
+    &SysThreadCreate,
+    &SysThreadJoin,
+    &SysThreadExit,
+    &SysGetTaskStats,
+    &SysSetChildCPUQuota,
+    &SysSetDeadline,
+    &SysYieldPeriod,
+    &SysExit,
+    &SysWait,
+    &SysGetEvents,
+    &SysWriteStdout,
+    &SysReadStdout,
+    &SysPipe,
+    &SysPipeClose,
+    &SysPipeRead,
+    &SysPipeWrite,
+    &SysLoadProgramWithPipes,
+    &SysWaitEvents,
+    &SysIPCSend,
+    &SysIPCCall,
+    &SysIPCReceive,
+    &SysIPCReply,
+    &SysIPCReplyReceive,
+    &SysFutexWait,
+    &SysFutexWake,
+    &SysShmCreate,
+    &SysShmMap,
+    &SysShmUnmap,
+    &SysFocusKeyboard,
+    &SysRingSetup,
+    &SysRingEnter
 };
 
-int HandleSyscalls(Registers syscall)
+static int DispatchSyscall(Registers* syscall)
 {
     // Get syscall type
-    const uint32_t type = syscall.eax;
+    const uint32_t type = syscall->eax;
 
     int returnValue = -1;
     if (type < sizeof(pSyscalls) / sizeof(pSyscalls[0])) returnValue = pSyscalls[type](syscall);
@@ -92,48 +157,91 @@ int HandleSyscalls(Registers syscall)
         VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
         VGA_printf("Invalid syscall");
     }
-    PIC_EndInterrupt(0x80);
     return returnValue;
 }
 
-static int SysPrintf(Registers syscall)
+int HandleSyscalls(Registers* syscall)
+{
+    // Counts trips into the kernel, however many syscalls a ring makes on each
+    Task* task = GetCurrentTask();
+    task->nSyscalls++;
+
+    // Its process was killed whilst it ran on another CPU (see ExitProcess)
+    if (task->bKillPending) TaskExit();
+    return DispatchSyscall(syscall);
+}
+
+// Set up by the BSP, for every CPU to follow
+static bool bFastSyscalls = false;
+
+void InitFastSyscalls()
+{
+    if (!IsSYSENTERSupported())
+    {
+        VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
+        VGA_printf("SYSENTER not supported, syscalls will use int 0x80");
+        return;
+    }
+
+    bFastSyscalls = true;
+    EnableFastSyscalls();
+
+    VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
+    VGA_printf("SYSENTER enabled");
+}
+
+void EnableFastSyscalls()
+{
+    // MSRs are per CPU, and each enters on the stack in its own TSS (see IRQSysenter)
+    if (!bFastSyscalls) return;
+    WriteMSR(MSR_SYSENTER_CS, 0x8, 0);
+    WriteMSR(MSR_SYSENTER_ESP, (uint32_t)&GetCPU()->tss.esp0, 0);
+    WriteMSR(MSR_SYSENTER_EIP, (uint32_t)&IRQSysenter, 0);
+}
+
+bool AreFastSyscallsEnabled()
+{
+    return bFastSyscalls;
+}
+
+static int SysPrintf(Registers* syscall)
 {
     // Sanity check address in ebx to check it's within range
-    if (!IsPageWithinUserBounds(syscall.ebx)) return -1;
+    if (!IsPageWithinUserBounds(syscall->ebx)) return -1;
 
-    OnStdout((char const*)syscall.ebx);
+    OnStdout((char const*)syscall->ebx);
 
     return 0;
 }
 
-static int SysNTasks(Registers syscall __attribute__((unused)))
+static int SysNTasks(Registers* syscall __attribute__((unused)))
 {
     return (int)GetNumberOfTasks();
 }
 
-static int SysSysexit(Registers syscall __attribute__((unused)))
+static int SysSysexit(Registers* syscall __attribute__((unused)))
 {
     OnSysexit();
-    TaskExit();
+    ExitProcess();
     return 0;
 }
 
-static int SysNPages(Registers syscall __attribute__((unused)))
+static int SysNPages(Registers* syscall __attribute__((unused)))
 {
     return (int)GetNumberOfPages();
 }
 
-static int SysPrintn (Registers syscall)
+static int SysPrintn (Registers* syscall)
 {
-    OnStdout(syscall.ebx, syscall.ecx);
+    OnStdout(syscall->ebx, syscall->ecx);
     return 0;
 }
 
-static int SysGetFramebufferAddr(Registers syscall __attribute__((unused))) { return (uint32_t) VGA_framebuffer.address;  }
-static int SysGetFramebufferWidth(Registers syscall __attribute__((unused))) { return (uint32_t) VGA_framebuffer.width;   }
-static int SysGetFramebufferHeight(Registers syscall __attribute__((unused))) { return (uint32_t) VGA_framebuffer.height; }
+static int SysGetFramebufferAddr(Registers* syscall __attribute__((unused))) { return (uint32_t) VGA_framebuffer.address;  }
+static int SysGetFramebufferWidth(Registers* syscall __attribute__((unused))) { return (uint32_t) VGA_framebuffer.width;   }
+static int SysGetFramebufferHeight(Registers* syscall __attribute__((unused))) { return (uint32_t) VGA_framebuffer.height; }
 
-static int SysMalloc(Registers syscall) 
+static int SysMalloc(Registers* syscall) 
 {
     auto RoundUpToNextPageSize = [&](uint32_t number)
     {
@@ -144,7 +252,7 @@ static int SysMalloc(Registers syscall)
     };
 
     // Round to nearest page
-    uint32_t size = RoundUpToNextPageSize(syscall.ebx);
+    uint32_t size = RoundUpToNextPageSize(syscall->ebx);
     
     // Add to current task's size
     TaskGrow(size);
@@ -152,7 +260,7 @@ static int SysMalloc(Registers syscall)
     return (int) kmalloc(size, USER_PAGE, false);
 }
 
-static int SysFree(Registers syscall) 
+static int SysFree(Registers* syscall) 
 { 
     auto RoundUpToNextPageSize = [&](uint32_t number)
     {
@@ -162,10 +270,10 @@ static int SysFree(Registers syscall)
         return number + PAGE_SIZE - remainder;
     };
 
-    void* data = (void*) syscall.ebx;
+    void* data = (void*) syscall->ebx;
 
     // Round to nearest page
-    uint32_t size = RoundUpToNextPageSize(syscall.ecx);
+    uint32_t size = RoundUpToNextPageSize(syscall->ecx);
     
     // Add to current task's size
     TaskGrow(-size);
@@ -175,158 +283,529 @@ static int SysFree(Registers syscall)
     return 0;
 }
 
-static int SysFileOpen(Registers syscall)
+static int SysFileOpen(Registers* syscall)
 {
-    return (int) kFileOpen((const char*)syscall.ebx);
+    return (int) kFileOpen((const char*)syscall->ebx);
 }
 
-static int SysGetFileSize(Registers syscall)
+static int SysGetFileSize(Registers* syscall)
 {
-    return (int) kGetFileSize((FileHandle)syscall.ebx);
+    return (int) kGetFileSize((FileHandle)syscall->ebx);
 }
 
-static int SysGetFileName(Registers syscall)
+static int SysGetFileName(Registers* syscall)
 {
-    char* name = kGetFileName((FileHandle)syscall.ebx);
-    strncpy((char*)syscall.ecx, name, MAX_FILE_NAME_LENGTH);
+    char* name = kGetFileName((FileHandle)syscall->ebx);
+    strncpy((char*)syscall->ecx, name, MAX_FILE_NAME_LENGTH);
     return 0;
 }
 
-static int SysFileRead(Registers syscall)
+static int SysFileRead(Registers* syscall)
 {
-    kFileRead((FileHandle)syscall.ebx, (void*)syscall.ecx, syscall.edx);
+    kFileRead((FileHandle)syscall->ebx, (void*)syscall->ecx, syscall->edx);
     return 0;
 }
 
-static int SysFileClose(Registers syscall)
+static int SysFileClose(Registers* syscall)
 {
-    kFileClose((FileHandle)syscall.ebx);
+    kFileClose((FileHandle)syscall->ebx);
     return 0;
 }
 
-static int SysGetNextFile(Registers syscall)
+static int SysGetNextFile(Registers* syscall)
 {
-    return (int)kGetNextFile((FileHandle)syscall.ebx);
+    return (int)kGetNextFile((FileHandle)syscall->ebx);
 }
 
-static int SysGetNextEvent(Registers syscall __attribute__((unused)))
+static int SysGetNextEvent(Registers* syscall __attribute__((unused)))
 {
     return (int)((uint32_t)GetNextEvent());
 }
 
-static int SysPushEvent(Registers syscall)
+static int SysPushEvent(Registers* syscall)
 {
-    uint32_t processID = syscall.ebx;
-    TaskEvent* event = (TaskEvent*)syscall.ecx;
+    uint32_t processID = syscall->ebx;
+    if (!IsPageWithinUserBounds(syscall->ecx) || !IsPageWithinUserBounds(syscall->ecx + sizeof(TaskEvent) - 1)) return -1;
+
+    // Copied in first, so the grant can't change between being checked and copied
+    TaskEvent event;
+    memcpy(&event, (void*)syscall->ecx, sizeof(TaskEvent));
+    if (event.length > EVENT_INLINE_SIZE)
+    {
+        if (event.length > EVENT_MAX_GRANT || event.grant + event.length < event.grant) return -1;
+        if (!IsPageWithinUserBounds(event.grant) || !IsPageWithinUserBounds(event.grant + event.length - 1)) return -1;
+    }
     
     Task* task = GetTaskWithProcessID(processID);
     if (task == nullptr) return -1;
 
-    return PushEvent(task, event);
+    int result = PushGrantEvent(task, &event);
+    ReleaseTask(task);
+    return result;
 }
 
-static int SysLoadProgram(Registers syscall)
+static int LoadProgram(const char* sName, uint32_t stdinEnd = PIPE_NONE, uint32_t stdoutEnd = PIPE_NONE)
 {
     // Open file
-    FileHandle file = kFileOpen((const char*)syscall.ebx);
+    FileHandle file = kFileOpen(sName);
     if (file == (FileHandle)-1) return -1;
 
     // Load into memory and parse
     void* fileBuffer = kmalloc(kGetFileSize(file));
     kFileRead(file, fileBuffer);
     auto elf = LoadElfFile(fileBuffer);
+    kfree(fileBuffer, kGetFileSize(file));
+    kFileClose(file);
 
     if (elf.error) return -1;
 
     // Create child task and return process ID
-    auto task = CreateChildTask((const char*)syscall.ebx, elf.entry, elf.size, elf.location);
-    kfree(fileBuffer, kGetFileSize(file));
-    kFileClose(file);
-
+    auto task = CreateChildTask(sName, elf.entry, elf.size, elf.location, stdinEnd, stdoutEnd);
     return (int)task->processID;
 }
 
-static int SysSubscribeToStdout(Registers syscall)
+static int SysLoadProgram(Registers* syscall)
 {
-    SubscribeToStdout(syscall.ebx);
+    // Copying and parsing the ELF file takes a while, so
+    // let interrupts (and other tasks) preempt us meanwhile
+    BeginPreemptibleSection();
+    int processID = LoadProgram((const char*)syscall->ebx);
+    EndPreemptibleSection();
+
+    return processID;
+}
+
+static int SysSubscribeToStdout(Registers* syscall)
+{
+    SubscribeToStdout(syscall->ebx);
     return 0;
 }
 
-static int SysGetProcess(Registers syscall)
+static int SysGetProcess(Registers* syscall)
 {
-    const char* process = (const char*)syscall.ebx;
+    const char* process = (const char*)syscall->ebx;
 
     return (int) GetProcess(process);
 }
 
-static int SysSubscribeToSysexit(Registers syscall)
+static int SysSubscribeToSysexit(Registers* syscall)
 {
-    SubscribeToSysexit(syscall.ebx);
+    SubscribeToSysexit(syscall->ebx);
     return 0;
 }
 
-static int SysGetSeconds(Registers syscall __attribute__((unused)))
+static int SysGetSeconds(Registers* syscall __attribute__((unused)))
 {
     return GetSeconds();
 }
 
-static int SysBlock(Registers syscall __attribute__((unused)))
+static int SysBlock(Registers* syscall __attribute__((unused)))
 {
     OnProcessBlock();
     return 0;
 }
 
-static int SysPopLastEvent(Registers syscall)
+static int SysPopLastEvent(Registers* syscall)
 {
-    return (int)PopLastEvent((uint32_t)syscall.ebx);
+    return (int)PopLastEvent((uint32_t)syscall->ebx);
 }
 
-static int SysGetKeyBufferAddr(Registers sycall __attribute__((unused)))
+static int SysGetKeyBufferAddr(Registers* sycall __attribute__((unused)))
 {
     return (int)GetKeyBufferAddress();
 }
 
-static int SysSubscribeToKeyboard(Registers syscall)
+static int SysSubscribeToKeyboard(Registers* syscall)
 {
-    SubscribeToKeyboard(syscall.ebx);
+    SubscribeToKeyboard(syscall->ebx);
     return 0;
 }
 
-static int SysGetSubseconds(Registers syscall __attribute__((unused)))
+static int SysGetSubseconds(Registers* syscall __attribute__((unused)))
 {
     return GetSubseconds();
 }
 
-static int SysBlockUntil(Registers syscall)
+static int SysBlockUntil(Registers* syscall)
 {
-    OnProcessBlock((uint32_t) syscall.ebx);
+    OnProcessBlock((uint32_t) syscall->ebx);
     return 0;
 }
 
-static int SysKill(Registers syscall)
+static int SysKill(Registers* syscall)
 {
-    uint32_t processID = syscall.ebx;
+    uint32_t processID = syscall->ebx;
     Task* task = GetTaskWithProcessID(processID);
-
     if (task == nullptr) return -1;
-    else { OnSysexit(processID); KillTask(task); }
-    
-    return 0;
+
+    int result = -1;
+    if (task->type != KERNEL_TASK && !task->bExited)
+    {
+        OnSysexit(task->pProcess->processID, (uint32_t)EXIT_CODE_KILLED);
+
+        // Our own process takes us with it, never to return - so let go first, and kill it through ourselves
+        if (task->pProcess == GetCurrentTask()->pProcess) { ReleaseTask(task); KillTask(GetCurrentTask()); }
+        KillTask(task);
+        result = 0;
+    }
+
+    ReleaseTask(task);
+    return result;
 }
 
-static int SysGetFirstFile(Registers syscall __attribute__((unused)))
+static int SysGetFirstFile(Registers* syscall __attribute__((unused)))
 {
     return (int)kGetFirstFile();
 }
 
-static int SysGetGDT(Registers syscall)
+static int SysGetGDT(Registers* syscall)
 {
-    void* data = (void*) syscall.ebx;
+    void* data = (void*) syscall->ebx;
     memcpy(data, GDTTable, sizeof(GDTTable));
     return 0;
 }
 
-static int SysNTotalPages(Registers syscall __attribute__((unused)))
+static int SysNTotalPages(Registers* syscall __attribute__((unused)))
 {
     return (int)GetNumberOfTotalPages();
 }
+
+static int SysThreadCreate(Registers* syscall)
+{
+    Task* thread = CreateThread(syscall->ebx, syscall->ecx, syscall->edx);
+    return (int)thread->processID;
+}
+
+static int SysThreadJoin(Registers* syscall)
+{
+    Task* thread = GetTaskWithProcessID(syscall->ebx);
+    if (thread == nullptr) return -1;
+
+    int result = (thread->type == KERNEL_TASK) ? -1 : JoinThread(thread);
+    ReleaseTask(thread);
+    return result;
+}
+
+static int SysThreadExit(Registers* syscall)
+{
+    ThreadExit(syscall->ebx);
+    return 0;
+}
+
+static int SysGetTaskStats(Registers* syscall)
+{
+    TaskStats* pStats = (TaskStats*)syscall->ebx;
+    uint32_t maxTasks = syscall->ecx;
+    if (maxTasks > GetNumberOfTasks()) maxTasks = GetNumberOfTasks();
+    if (maxTasks == 0) return 0;
+
+    // Filled in with interrupts off, so it had better all be there
+    if (!IsPageWithinUserBounds((uint32_t)pStats) || !IsPageWithinUserBounds((uint32_t)&pStats[maxTasks] - 1)) return -1;
+
+    return (int)GetTaskStats(pStats, maxTasks);
+}
+
+static int SysSetChildCPUQuota(Registers* syscall)
+{
+    return SetChildCPUQuota(syscall->ebx, syscall->ecx);
+}
+
+static int SysSetDeadline(Registers* syscall)
+{
+    return SetDeadline(syscall->ebx, syscall->ecx, syscall->edx);
+}
+
+static int SysYieldPeriod(Registers* syscall __attribute__((unused)))
+{
+    return YieldPeriod();
+}
+
+static int SysExit(Registers* syscall)
+{
+    OnSysexit(syscall->ebx);
+    ExitProcess(nullptr, syscall->ebx);
+    return 0;
+}
+
+static int SysWait(Registers* syscall)
+{
+    int* pStatus = (int*)syscall->ecx;
+    if (pStatus != nullptr && !IsPageWithinUserBounds((uint32_t)pStatus)) return -1;
+
+    return WaitForChild(syscall->ebx, pStatus);
+}
+
+static int SysGetEvents(Registers* syscall)
+{
+    TaskEvent* pEvents = (TaskEvent*)syscall->ebx;
+    uint32_t maxEvents = syscall->ecx;
+    if (maxEvents > MAX_TASK_EVENTS) maxEvents = MAX_TASK_EVENTS; // never more queued than that
+
+    // Copied in with interrupts off, so it had better all be there
+    if (maxEvents != 0 && (!IsPageWithinUserBounds((uint32_t)pEvents) || !IsPageWithinUserBounds((uint32_t)&pEvents[maxEvents] - 1))) return -1;
+
+    return GetEvents(pEvents, maxEvents, syscall->edx);
+}
+
+static int SysWriteStdout(Registers* syscall)
+{
+    const char* pData = (const char*)syscall->ebx;
+    uint32_t length = syscall->ecx;
+    if (length == 0) return 0;
+
+    // Copied out with interrupts off, so it had better all be there
+    if ((uint32_t)pData + length < (uint32_t)pData) return -1;
+    if (!IsPageWithinUserBounds((uint32_t)pData) || !IsPageWithinUserBounds((uint32_t)pData + length - 1)) return -1;
+
+    return WriteStdout(pData, length);
+}
+
+static int SysReadStdout(Registers* syscall)
+{
+    char* pBuffer = (char*)syscall->ecx;
+    uint32_t size = syscall->edx;
+    if (size > STDOUT_BUFFER_SIZE) size = STDOUT_BUFFER_SIZE; // never more buffered than that
+    if (size == 0) return 0;
+
+    // Copied in with interrupts off, so it had better all be there
+    if (!IsPageWithinUserBounds((uint32_t)pBuffer) || !IsPageWithinUserBounds((uint32_t)pBuffer + size - 1)) return -1;
+
+    return ReadStdout(syscall->ebx, pBuffer, size);
+}
+
+static int SysPipe(Registers* syscall)
+{
+    uint32_t* pEnds = (uint32_t*)syscall->ebx;
+    if (!IsPageWithinUserBounds((uint32_t)pEnds) || !IsPageWithinUserBounds((uint32_t)&pEnds[2] - 1)) return -1;
+
+    return CreatePipe(pEnds);
+}
+
+static int SysPipeClose(Registers* syscall)
+{
+    return ClosePipeEnd(syscall->ebx);
+}
+
+static int SysPipeRead(Registers* syscall)
+{
+    char* pBuffer = (char*)syscall->ecx;
+    uint32_t size = syscall->edx;
+    if (size > STDOUT_BUFFER_SIZE) size = STDOUT_BUFFER_SIZE; // never more buffered than that, bar a page
+    if (size == 0) return 0;
+
+    // Copied in with interrupts off, so it had better all be there
+    if (!IsPageWithinUserBounds((uint32_t)pBuffer) || !IsPageWithinUserBounds((uint32_t)pBuffer + size - 1)) return -1;
+
+    return PipeRead(syscall->ebx, pBuffer, size);
+}
+
+static int SysPipeWrite(Registers* syscall)
+{
+    const char* pData = (const char*)syscall->ecx;
+    uint32_t length = syscall->edx;
+    if (length == 0) return 0;
+
+    // Copied out with interrupts off, so it had better all be there
+    if ((uint32_t)pData + length < (uint32_t)pData) return -1;
+    if (!IsPageWithinUserBounds((uint32_t)pData) || !IsPageWithinUserBounds((uint32_t)pData + length - 1)) return -1;
+
+    return PipeWrite(syscall->ebx, pData, length);
+}
+
+static int SysLoadProgramWithPipes(Registers* syscall)
+{
+    uint32_t stdinEnd = syscall->ecx;
+    uint32_t stdoutEnd = syscall->edx;
+    if (stdinEnd != PIPE_NONE && !IsPipeEnd(stdinEnd, false)) return -1;
+    if (stdoutEnd != PIPE_NONE && !IsPipeEnd(stdoutEnd, true)) return -1;
+
+    // See SysLoadProgram
+    BeginPreemptibleSection();
+    int processID = LoadProgram((const char*)syscall->ebx, stdinEnd, stdoutEnd);
+    EndPreemptibleSection();
+
+    return processID;
+}
+
+static int SysWaitEvents(Registers* syscall)
+{
+    // Copied into the kernel, so the same buffer can't change under us while blocked
+    const uint32_t* pIDs = (const uint32_t*)syscall->ebx;
+    uint32_t nIDs = syscall->ecx;
+    if (nIDs > MAX_WAIT_EVENTS) nIDs = MAX_WAIT_EVENTS;
+    if (nIDs != 0 && (!IsPageWithinUserBounds((uint32_t)pIDs) || !IsPageWithinUserBounds((uint32_t)&pIDs[nIDs] - 1))) return -1;
+
+    uint32_t ids[MAX_WAIT_EVENTS];
+    for (uint32_t i = 0; i < nIDs; ++i) ids[i] = pIDs[i];
+
+    return (int)WaitEvents(ids, nIDs, syscall->edx);
+}
+
+static bool IsIPCMessageWithinUserBounds(uint32_t address)
+{
+    return IsPageWithinUserBounds(address) && IsPageWithinUserBounds(address + sizeof(IPCMessage) - 1);
+}
+
+static int SysIPCSend(Registers* syscall)
+{
+    if (!IsIPCMessageWithinUserBounds(syscall->ecx)) return -1;
+    return IPCSend(syscall->ebx, (const IPCMessage*)syscall->ecx);
+}
+
+static int SysIPCCall(Registers* syscall)
+{
+    // The reply's copied back over the message on our own kernel stack, so it lands in our memory
+    if (!IsIPCMessageWithinUserBounds(syscall->ecx)) return -1;
+
+    IPCMessage message;
+    memcpy(&message, (void*)syscall->ecx, sizeof(IPCMessage));
+    int result = IPCCall(syscall->ebx, &message);
+    if (result == 0) memcpy((void*)syscall->ecx, &message, sizeof(IPCMessage));
+    return result;
+}
+
+static int SysIPCReceive(Registers* syscall)
+{
+    if (!IsIPCMessageWithinUserBounds(syscall->ebx)) return -1;
+
+    IPCMessage message;
+    int sender = IPCReceive(&message);
+    memcpy((void*)syscall->ebx, &message, sizeof(IPCMessage));
+    return sender;
+}
+
+static int SysIPCReply(Registers* syscall)
+{
+    if (!IsIPCMessageWithinUserBounds(syscall->ecx)) return -1;
+    return IPCReply(syscall->ebx, (const IPCMessage*)syscall->ecx);
+}
+
+static int SysIPCReplyReceive(Registers* syscall)
+{
+    if (!IsIPCMessageWithinUserBounds(syscall->ecx)) return -1;
+
+    IPCMessage message;
+    memcpy(&message, (void*)syscall->ecx, sizeof(IPCMessage));
+    int sender = IPCReplyReceive(syscall->ebx, &message);
+    memcpy((void*)syscall->ecx, &message, sizeof(IPCMessage));
+    return sender;
+}
+
+static bool IsFutexWithinUserBounds(uint32_t address)
+{
+    // Aligned, so it can't straddle two pages
+    return address % sizeof(uint32_t) == 0 && IsPageWithinUserBounds(address);
+}
+
+static int SysFutexWait(Registers* syscall)
+{
+    if (!IsFutexWithinUserBounds(syscall->ebx)) return -1;
+    return FutexWait((uint32_t*)syscall->ebx, syscall->ecx, syscall->edx);
+}
+
+static int SysFutexWake(Registers* syscall)
+{
+    if (!IsFutexWithinUserBounds(syscall->ebx)) return -1;
+    return FutexWake((uint32_t*)syscall->ebx, syscall->ecx);
+}
+
+static int SysShmCreate(Registers* syscall)
+{
+    return CreateSharedRegion(syscall->ebx);
+}
+
+static int SysShmMap(Registers* syscall)
+{
+    return (int)MapSharedRegion(syscall->ebx);
+}
+
+static int SysShmUnmap(Registers* syscall)
+{
+    return UnmapSharedRegion(syscall->ebx);
+}
+
+static int SysFocusKeyboard(Registers* syscall)
+{
+    return FocusKeyboard(syscall->ebx);
+}
+
+// Made straight away, rather than through a ring - rings themselves, those that never
+// return (kill may be of ourselves), and those whose whole point is to wait, which would
+// hold up everything after them. Pipes and stdout can still block a batch when full
+static int (* const pNotInRings[])(Registers* syscall) =
+{
+    &SysRingSetup,
+    &SysRingEnter,
+    &SysSysexit,
+    &SysExit,
+    &SysThreadExit,
+    &SysKill,
+    &SysBlock,
+    &SysBlockUntil,
+    &SysThreadJoin,
+    &SysYieldPeriod,
+    &SysWait,
+    &SysGetEvents,
+    &SysWaitEvents,
+    &SysIPCSend,
+    &SysIPCCall,
+    &SysIPCReceive,
+    &SysIPCReply,
+    &SysIPCReplyReceive,
+    &SysFutexWait
+};
+
+static bool IsAllowedInRing(uint32_t type)
+{
+    if (type >= sizeof(pSyscalls) / sizeof(pSyscalls[0])) return false;
+    for (uint32_t i = 0; i < sizeof(pNotInRings) / sizeof(pNotInRings[0]); ++i)
+    {
+        if (pSyscalls[type] == pNotInRings[i]) return false;
+    }
+    return true;
+}
+
+static int SysRingSetup(Registers* syscall __attribute__((unused)))
+{
+    // One per thread, for as long as it lives
+    Task* task = GetCurrentTask();
+    if (task->pSyscallRing == nullptr) task->pSyscallRing = (SyscallRing*)kmalloc(sizeof(SyscallRing), USER_PAGE, false);
+    return (int)task->pSyscallRing;
+}
+
+static int SysRingEnter(Registers* syscall __attribute__((unused)))
+{
+    SyscallRing* pRing = GetCurrentTask()->pSyscallRing;
+    if (pRing == nullptr) return -1;
+
+    // Everything submitted so far, in order, for as long as there's room for completions
+    uint32_t head = pRing->submissionHead;
+    uint32_t tail = __atomic_load_n(&pRing->submissionTail, __ATOMIC_ACQUIRE);
+    uint32_t completionTail = pRing->completionTail;
+    uint32_t nCompleted = 0;
+    for (; head != tail; ++head)
+    {
+        if (completionTail - __atomic_load_n(&pRing->completionHead, __ATOMIC_ACQUIRE) >= SYSCALL_RING_ENTRIES) break;
+
+        // Copied out, as the task may be writing to the ring as we go
+        SubmissionEntry entry;
+        memcpy(&entry, &pRing->submissions[head & (SYSCALL_RING_ENTRIES - 1)], sizeof(SubmissionEntry));
+
+        Registers registers = {};
+        registers.eax = entry.syscall;
+        registers.ebx = entry.args[0];
+        registers.ecx = entry.args[1];
+        registers.edx = entry.args[2];
+
+        int result = IsAllowedInRing(entry.syscall) ? DispatchSyscall(&registers) : -1;
+
+        CompletionEntry* pCompletion = &pRing->completions[completionTail & (SYSCALL_RING_ENTRIES - 1)];
+        pCompletion->userData = entry.userData;
+        pCompletion->result = result;
+        __atomic_store_n(&pRing->completionTail, ++completionTail, __ATOMIC_RELEASE);
+        __atomic_store_n(&pRing->submissionHead, head + 1, __ATOMIC_RELEASE);
+        nCompleted++;
+    }
+
+    return (int)nCompleted;
+}
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include "acpi.h"
+#include "../memory/paging.h"
+#include "../gfx/vga.h"
+
+static bool IsChecksumValid(const void* pTable, uint32_t length)
+{
+    // All bytes must add up to 0
+    const uint8_t* pBytes = (const uint8_t*)pTable;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; ++i) sum = (uint8_t)(sum + pBytes[i]);
+    return sum == 0;
+}
+
+static bool HasSignature(const char* pSignature, const char* sExpected, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; ++i)
+        if (pSignature[i] != sExpected[i]) return false;
+    return true;
+}
+
+static RSDP* FindRSDPInRange(uint32_t start, uint32_t end)
+{
+    // Always on a 16 byte boundary
+    for (uint32_t address = start; address < end; address += 16)
+    {
+        RSDP* pRSDP = (RSDP*)address;
+        if (HasSignature(pRSDP->signature, "RSD PTR ", 8) && IsChecksumValid(pRSDP, sizeof(RSDP))) return pRSDP;
+    }
+
+    return nullptr;
+}
+
+static RSDP* FindRSDP()
+{
+    // First KB of the EBDA, then the BIOS area below 1MB (both identity mapped)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"
+    uint32_t ebda = (uint32_t)(*(uint16_t*)0x40E) << 4;
+#pragma GCC diagnostic pop
+    RSDP* pRSDP = (ebda != 0) ? FindRSDPInRange(ebda, ebda + 1024) : nullptr;
+    if (pRSDP == nullptr) pRSDP = FindRSDPInRange(0xE0000, 0x100000);
+    return pRSDP;
+}
+
+static SDTHeader* MapTable(uint32_t address)
+{
+    // Tables usually sit past the end of usable memory, so aren't mapped
+    auto MapPages = [](uint32_t start, uint32_t length)
+    {
+        for (uint32_t page = start & ~(PAGE_SIZE - 1); page < start + length; page += PAGE_SIZE)
+            AllocatePage(page, page, KERNEL_PAGE, true);
+    };
+
+    MapPages(address, sizeof(SDTHeader));
+    SDTHeader* pHeader = (SDTHeader*)address;
+    MapPages(address, pHeader->length);
+
+    return IsChecksumValid(pHeader, pHeader->length) ? pHeader : nullptr;
+}
+
+bool GetCPUTopology(CPUTopology* pTopology)
+{
+    RSDP* pRSDP = FindRSDP();
+    if (pRSDP == nullptr) return false;
+
+    SDTHeader* pRSDT = MapTable(pRSDP->rsdtAddress);
+    if (pRSDT == nullptr) return false;
+
+    // Look through the RSDT for the MADT ("APIC")
+    uint32_t nTables = (pRSDT->length - sizeof(SDTHeader)) / 4;
+    uint32_t* pTables = (uint32_t*)((uint32_t)pRSDT + sizeof(SDTHeader));
+    MADT* pMADT = nullptr;
+    for (uint32_t i = 0; i < nTables && pMADT == nullptr; ++i)
+    {
+        SDTHeader* pTable = MapTable(pTables[i]);
+        if (pTable != nullptr && HasSignature(pTable->signature, "APIC", 4)) pMADT = (MADT*)pTable;
+    }
+    if (pMADT == nullptr) return false;
+
+    pTopology->localAPICAddress = pMADT->localAPICAddress;
+    pTopology->nCPUs = 0;
+
+    // One local APIC entry per CPU, whether it can be used or not
+    uint32_t entry = (uint32_t)pMADT + sizeof(MADT);
+    uint32_t end = (uint32_t)pMADT + pMADT->header.length;
+    while (entry < end)
+    {
+        MADTLocalAPIC* pEntry = (MADTLocalAPIC*)entry;
+        if (pEntry->length == 0) break;
+
+        if (pEntry->type == MADT_ENTRY_LOCAL_APIC && (pEntry->flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)) && pTopology->nCPUs < ACPI_MAX_CPUS)
+            pTopology->apicIDs[pTopology->nCPUs++] = pEntry->apicID;
+
+        entry += pEntry->length;
+    }
+
+    return pTopology->nCPUs != 0;
+}
@@ -0,0 +1,83 @@
+#include "apic.h"
+#include "../memory/paging.h"
+#include "../interrupts/interrupts.h"
+#include "../interrupts/timer.h"
+
+static volatile uint32_t* pLocalAPIC = nullptr;
+
+// Timer ticks (divided by 16) in one PIT tick, i.e. 1/120th of a second
+static uint32_t timerTicksPerPeriod = 0;
+
+static inline uint32_t ReadLocalAPIC(uint32_t reg)               { return pLocalAPIC[reg / 4]; }
+static inline void WriteLocalAPIC(uint32_t reg, uint32_t value)  { pLocalAPIC[reg / 4] = value; }
+
+void InitLocalAPIC(uint32_t address)
+{
+    // Registers are memory mapped, and well above anything paging has touched
+    AllocatePage(address, address, KERNEL_PAGE, true);
+    pLocalAPIC = (volatile uint32_t*)address;
+}
+
+void EnableLocalAPIC()
+{
+    WriteLocalAPIC(APIC_SPURIOUS, APIC_SOFTWARE_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+uint32_t GetLocalAPICID()
+{
+    return ReadLocalAPIC(APIC_ID) >> 24;
+}
+
+void LocalAPICEndInterrupt()
+{
+    WriteLocalAPIC(APIC_EOI, 0);
+}
+
+void CalibrateLocalAPICTimer()
+{
+    // Count down from the top for exactly one PIT tick
+    WriteLocalAPIC(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    WriteLocalAPIC(APIC_LVT_TIMER, APIC_LVT_MASKED);
+
+    EnableInterrupts();
+    uint32_t subseconds = GetSubseconds();
+    while (GetSubseconds() == subseconds) asm volatile("pause");
+
+    WriteLocalAPIC(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+    subseconds = GetSubseconds();
+    while (GetSubseconds() == subseconds) asm volatile("pause");
+    DisableInterrupts();
+
+    timerTicksPerPeriod = 0xFFFFFFFF - ReadLocalAPIC(APIC_TIMER_CURRENT);
+    WriteLocalAPIC(APIC_TIMER_INITIAL, 0);
+}
+
+void StartLocalAPICTimer()
+{
+    // Same rate as the PIT drives the BSP's scheduler at
+    WriteLocalAPIC(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    WriteLocalAPIC(APIC_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    WriteLocalAPIC(APIC_TIMER_INITIAL, timerTicksPerPeriod);
+}
+
+void LocalAPICDelay(uint32_t microseconds)
+{
+    // One-shot and masked, just poll it
+    uint64_t ticks = (uint64_t)timerTicksPerPeriod * 120 * microseconds / 1000000;
+    WriteLocalAPIC(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    WriteLocalAPIC(APIC_LVT_TIMER, APIC_LVT_MASKED);
+    WriteLocalAPIC(APIC_TIMER_INITIAL, (uint32_t)(ticks == 0 ? 1 : ticks));
+    while (ReadLocalAPIC(APIC_TIMER_CURRENT) != 0) asm volatile("pause");
+}
+
+static void SendInterprocessorInterrupt(uint32_t apicID, uint32_t command)
+{
+    WriteLocalAPIC(APIC_ICR_HIGH, apicID << 24);
+    WriteLocalAPIC(APIC_ICR_LOW, command);
+    while (ReadLocalAPIC(APIC_ICR_LOW) & APIC_ICR_PENDING) asm volatile("pause");
+}
+
+void SendInitIPI(uint32_t apicID)                   { SendInterprocessorInterrupt(apicID, APIC_ICR_INIT);            }
+void SendStartupIPI(uint32_t apicID, uint8_t page)  { SendInterprocessorInterrupt(apicID, APIC_ICR_STARTUP | page);  }
+void SendIPI(uint32_t apicID, uint8_t vector)       { SendInterprocessorInterrupt(apicID, APIC_ICR_FIXED | vector);  }
+void BroadcastIPI(uint8_t vector)                   { SendInterprocessorInterrupt(0, APIC_ICR_FIXED | APIC_ICR_ALL_BUT_SELF | vector); }
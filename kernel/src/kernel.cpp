@@ -14,13 +14,14 @@
 #include "interrupts/timer.h"
 #include "multitask/taskSwitch.h"
 #include "multitask/multitask.h"
+#include "multitask/fpu.h"
 #include "multitask/modules.h"
 #include "multitask/elf.h"
+#include "multitask/smp.h"
 #include "file/filesystem.h"
 #include "stdlib.h"
 
 extern uint32_t __tss_stack;
-TSS tssEntry;
 multiboot_info_t* pMultiboot;
 
 extern "C" void kernel_main(multiboot_info_t* mbd) 
@@ -47,7 +48,7 @@ extern "C" void kernel_main(multiboot_info_t* mbd)
     VGA_printf<uint16_t, true>((uint16_t)COM1.m_Com);
 
     // Create TSS
-    tssEntry = CreateTSSEntry((uint32_t)&__tss_stack, 0x10); // Stack pointer and ring 0 data selector 
+    cpus[0].tss = CreateTSSEntry((uint32_t)&__tss_stack, 0x10); // Stack pointer and ring 0 data selector 
 
     // Construct GDT entries (0xFFFFF actually translates to all of memory)
     GDTTable[0] = CreateGDTEntry(0, 0, 0);                                          // GDT entry at 0x0 cannot be used
@@ -55,14 +56,16 @@ extern "C" void kernel_main(multiboot_info_t* mbd)
     GDTTable[2] = CreateGDTEntry(0x00000000, 0xFFFFF, GDT_DATA_PL0);                // Data      - 0x10
     GDTTable[3] = CreateGDTEntry(0x00000000, 0xFFFFF, GDT_CODE_PL3);                // User code - 0x18
     GDTTable[4] = CreateGDTEntry(0x00000000, 0xFFFFF, GDT_DATA_PL3);                // User data - 0x20
-    GDTTable[5] = CreateGDTEntry((uint32_t) &tssEntry, sizeof(tssEntry), TSS_PL0);  // TSS       - 0x28
+    GDTTable[5] = CreateGDTEntry((uint32_t) &cpus[0].tss, sizeof(TSS), TSS_PL0);    // TSS       - 0x28
+    GDTTable[6] = CreateGDTEntry(0x00000000, 0xFFFFF, GDT_DATA_PL3);                // User TLS  - 0x30
+    GDTTable[7] = CreateGDTEntry((uint32_t) &cpus[0], 0xFFFFF, GDT_DATA_PL0);       // CPU data  - 0x38
 
     // Load GDT
     LoadGDT(GDTTable, sizeof(GDTTable));
     VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
     VGA_printf("GDT sucessfully loaded");
     VGA_printf("");
-    PrintGDT(GDTTable, 6);
+    PrintGDT(GDTTable, GDT_ENTRIES);
     VGA_printf("");
 
     // Load TSS
@@ -70,6 +73,9 @@ extern "C" void kernel_main(multiboot_info_t* mbd)
     VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
     VGA_printf("TSS sucessfully loaded");
 
+    // Per-CPU data through fs, which every interrupt relies on
+    InitBootCPU();
+
     // Read memory map from GRUB
     if ((mbd->flags & 6) == 0) {  VGA_printf("[Failure] Multiboot error!", true, VGA_COLOUR_LIGHT_RED); }
 
@@ -93,24 +99,22 @@ extern "C" void kernel_main(multiboot_info_t* mbd)
     // Setup keyboard driver
     KeyboardInit();
 
-    // Test for SSE
-    bool bSSE = IsSSESupported();
-    if (bSSE)
-    {
-        VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
-        VGA_printf("SSE2 supported");
-        EnableSSE();
-    }
-    else
-    {
-        VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
-        VGA_printf("SSE not supported!");
-    }
+    // Test for SSE, XSAVE and AVX
+    InitFPU();
+
+    // Test for SYSENTER
+    InitFastSyscalls();
 
     // Load GRUB modules and build filesystem
     uint32_t vfsAddress = LoadGrubVFS(pMultiboot);
     BuildVFS(vfsAddress);
 
+    // Bring up the other CPUs
+    InitSMP();
+
+    // Start background kernel tasks
+    InitMultitasking();
+
     // Load window manager
     FileHandle cli = kFileOpen("cli");
     void* cliBuffer = kmalloc(kGetFileSize(cli));
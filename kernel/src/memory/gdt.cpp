@@ -1,7 +1,14 @@
 #include "gdt.h"
 #include "../gfx/vga.h"
+#include "../multitask/smp.h"
 
-uint64_t GDTTable[6];
+uint64_t GDTTable[GDT_ENTRIES];
+
+void SetThreadLocalStorage(const uint32_t base)
+{
+    // Picked up next time gs is loaded, i.e. on the way back to ring 3
+    GetCPU()->pGDT[GDT_TLS_ENTRY] = CreateGDTEntry(base, 0xFFFFF, GDT_DATA_PL3);
+}
 
 void PrintGDT(const uint64_t* pTable, const unsigned int nEntries)
 {
@@ -1,5 +1,6 @@
 #include "paging.h"
 #include "../gfx/vga.h"
+#include "../multitask/smp.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Warray-bounds"
@@ -23,6 +24,9 @@ static uint32_t* pageTables;
 static Page* pageListArray;
 uint32_t maxPhysicalPages;
 
+// Page allocation may be preempted, and is far from atomic
+KernelLock kmallocLock;
+
 extern uint32_t __tss_stack;
 
 void InitPaging(const uint32_t maxAddress)
@@ -140,6 +144,29 @@ void DeallocatePageDirectory(uint32_t virtualAddress, uint32_t flags)
     FlushTLB();
 }
 
+uint32_t* CreatePageDirectory(uint32_t** ppUserWindow)
+{
+    // Kernel page tables are shared (and never move), the user window's are not
+    uint32_t* pageDirectory = (uint32_t*)kmalloc(pageSize);
+    memcpy(pageDirectory, pageDirectories, sizeof(uint32_t) * numDirectories);
+
+    uint32_t* userWindow = (uint32_t*)kmalloc(pageSize * USER_WINDOW_DIRECTORIES);
+    for (uint32_t i = 0; i < USER_WINDOW_DIRECTORIES; ++i)
+        pageDirectory[USER_WINDOW_ADDRESS / pageDirectorySize + i] = (uint32_t)(userWindow + numPages*i) | USER_DIRECTORY;
+
+    *ppUserWindow = userWindow;
+    return pageDirectory;
+}
+
+void MapUserWindow(uint32_t* pUserWindow, uint32_t location, uint32_t nPages, uint32_t nOldPages)
+{
+    // Only touches the current CPU's tables, so no need for a lock
+    for (uint32_t i = 0; i < nOldPages; ++i) pUserWindow[i] = PD_PRESENT(0);
+    for (uint32_t i = 0; i < nPages; ++i) pUserWindow[i] = (location + i*pageSize) | USER_PAGE;
+
+    FlushTLB();
+}
+
 void* kmalloc(uint32_t bytes, uint32_t flags, bool kernel)
 {
     // Yes, I *know* this is very inefficient, wastteful, etc but...
@@ -155,6 +182,8 @@ void* kmalloc(uint32_t bytes, uint32_t flags, bool kernel)
 
     uint32_t pagesRequired = RoundUpToNextPageSize(bytes) / pageSize;
 
+    AcquireLock(&kmallocLock);
+
     // Go through each page until a group of pages are found that satisfy the size requirements
     // TODO: Optimise - if the next X pages are full, simply skip them
     for (uint32_t i = 0; i < maxPhysicalPages; ++i)
@@ -174,6 +203,8 @@ void* kmalloc(uint32_t bytes, uint32_t flags, bool kernel)
                 for (uint32_t p = 0; p < pagesRequired; ++p)
                     AllocatePage(pageAddress+pageSize*p, pageAddress+pageSize*p, flags, kernel);
 
+                ReleaseLock(&kmallocLock);
+
                 // Clear pages too
                 memset((void*)pageAddress, 0, pageSize*pagesRequired);
                 
@@ -182,6 +213,8 @@ void* kmalloc(uint32_t bytes, uint32_t flags, bool kernel)
         }
     }
 
+    ReleaseLock(&kmallocLock);
+
     VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
     VGA_printf("kmalloc ran out of pages!");
 
@@ -201,8 +234,13 @@ void kfree(void* ptr, uint32_t bytes)
     
     uint32_t pagesRequired = RoundUpToNextPageSize(bytes) / pageSize;
 
+    AcquireLock(&kmallocLock);
     for (uint32_t i = 0; i < pagesRequired; ++i)
         DeallocatePage((uint32_t)ptr + i*pageSize);
+    ReleaseLock(&kmallocLock);
+
+    // Pages may come back with different flags, which other CPUs mustn't have cached
+    FlushOtherCPUsTLB();
 }
 
 void PrintPaging()
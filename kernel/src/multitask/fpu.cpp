@@ -0,0 +1,75 @@
+#include "fpu.h"
+#include "../io/cpu.h"
+#include "../memory/paging.h"
+#include "../gfx/vga.h"
+
+// fxsave by default, XSAVE (and friends) when CPUID says so
+static uint32_t fpuStateSize = FXSAVE_AREA_SIZE;
+static void (*pSaveState)(void*) = &FXSaveState;
+static void (*pRestoreState)(void*) = &FXRestoreState;
+
+// What InitFPU enabled, for the other CPUs to follow
+static bool bSSEEnabled = false;
+static uint32_t xsaveFeatures = 0;
+
+void InitFPU()
+{
+    // Test for SSE
+    if (!IsSSESupported())
+    {
+        VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
+        VGA_printf("SSE not supported!");
+        return;
+    }
+
+    VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
+    VGA_printf("SSE2 supported");
+    EnableSSE();
+    bSSEEnabled = true;
+
+    // Without XSAVE, AVX can't be enabled (or preserved) either
+    if (!IsXSAVESupported()) return;
+
+    uint32_t features = XCR0_X87 | XCR0_SSE;
+    if (IsAVXSupported()) features |= XCR0_AVX;
+    EnableXSAVE(features);
+    xsaveFeatures = features;
+
+    // Area size depends on what XCR0 now has enabled
+    fpuStateSize = GetXSAVEAreaSize();
+    pRestoreState = &XRestoreState;
+    pSaveState = IsXSAVEOPTSupported() ? &XSaveOptState : &XSaveState;
+
+    VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
+    VGA_printf(IsXSAVEOPTSupported() ? "XSAVEOPT" : "XSAVE", false);
+    VGA_printf(features & XCR0_AVX ? " with AVX enabled - " : " enabled - ", false);
+    VGA_printf(fpuStateSize, false);
+    VGA_printf(" bytes per task");
+}
+
+void EnableFPU()
+{
+    // Control registers are per CPU, so APs need the same setup
+    if (bSSEEnabled) EnableSSE();
+    if (xsaveFeatures != 0) EnableXSAVE(xsaveFeatures);
+}
+
+uint8_t* CreateFPUState()
+{
+    // kmalloc is page aligned and zeroed, which satisfies both
+    // fxsave's 16-byte and XSAVE's 64-byte alignment, and leaves the
+    // XSAVE header empty so that xrstor starts each component in its
+    // initial configuration
+    uint8_t* pState = (uint8_t*) kmalloc(fpuStateSize);
+    *(uint16_t*)(pState + 0) = 0x37F;  // default x87 control word
+    *(uint32_t*)(pState + 24) = 0x1F80; // default MXCSR - all SIMD exceptions masked
+    return pState;
+}
+
+void FreeFPUState(uint8_t* pState)
+{
+    kfree(pState, fpuStateSize);
+}
+
+void SaveFPUState(uint8_t* pState)      { pSaveState(pState);    }
+void RestoreFPUState(uint8_t* pState)   { pRestoreState(pState); }
@@ -1,458 +1,2646 @@
 #include "multitask.h"
 #include "../interrupts/interrupts.h"
 #include "../memory/paging.h"
+#include "../memory/tss.h"
+#include "../memory/gdt.h"
 #include "../gfx/vga.h"
+#include "../io/cpu.h"
 #include "stdlib.h"
 #include "taskSwitch.h"
+#include "fpu.h"
+#include "lock.h"
+#include "smp.h"
+#include "../io/apic.h"
+
+// Each task's queue is given a page of its own (see AllocateTask)
+static_assert(sizeof(TaskEventQueue) <= PAGE_SIZE, "Event queue must fit in a page");
 
 bool bEnableMultitasking = false;
 
 // Linked list of tasks
 Task* pTaskListHead = nullptr;
 Task* pTaskListTail = nullptr;
-Task* pCurrentTask = nullptr;
 size_t nTasks = 0;
 
-// Ring 0 vs Ring 3
-static uint32_t lastUserTaskPages = 0;
-static uint32_t processIDCount = 1;
+// Always taken with interrupts off, and in this order
+static SpinLock taskListLock;   // the list above
+static SpinLock eventLock;      // every task's event queue
+static SpinLock schedulerLock;  // run queues, FPU owners and whether tasks are blocked or running
 
-Task* CreateTask(char const* sName, uint32_t entry, uint32_t size, uint32_t location, uint32_t parentID)
-{
-    // Create new task in memory and linked list
-    Task* task = (Task*) kmalloc(sizeof(Task), USER_PAGE);
-    task->processID = processIDCount;
-    task->parentID = parentID;
-    strncpy(task->sName, sName, 32);
-    task->bBlocked = false;
+// Exited tasks whose kernel stacks can't be freed until we're off them
+static Task* pDeadTasks = nullptr;
+static Task* pReaperTask = nullptr;
 
-    // Round task to nearest page
-    uint32_t originalSize = size;
-    uint32_t roundedSize = originalSize;
-    uint32_t remainder = roundedSize % PAGE_SIZE;
-    if (remainder != 0) roundedSize += PAGE_SIZE - remainder;
-    task->size = roundedSize;
-    task->location = location;
+// Process table and name index, both guarded by taskListLock
+static Task* pTasksByID[PROCESS_TABLE_SIZE];
+static Task* pProcessesByName[PROCESS_TABLE_SIZE];
+static uint32_t processIDCount = 1;
 
-    // Allocate stack
-    uint32_t stack = (uint32_t)kmalloc(4096, USER_PAGE, false);
-    task->pStack = (uint32_t*)(stack + 4096 - 16); // Stack grows downwards
-    uint32_t* pStackTop = task->pStack;
-    task->pOriginalStack = (uint32_t*)stack;
-    
-    // Allocate event queue
-    task->pEventQueue = (TaskEventQueue*) kmalloc(sizeof(TaskEventQueue), USER_PAGE, false);
-    task->pEventQueue->nEvents = 0;
-
-    // Push blank registers onto the stack
-    *--task->pStack = 0x00;   // stack alignment (if any)
-    *--task->pStack = 0x23;   // stack segment (ss)
-    *--task->pStack = (uint32_t) pStackTop; // esp
-    *--task->pStack = 0x202; // eflags - default value with interrupts enabled
-    *--task->pStack = 0x1B;    // cs (iret uses a 32-bit pop - don't panic!)
-    *--task->pStack = entry;  // eip
-    *--task->pStack = 0;      // eax
-    *--task->pStack = 0;      // ebx
-    *--task->pStack = 0;      // ecx
-    *--task->pStack = 0;      // edx
-    *--task->pStack = 0;      // esi
-    *--task->pStack = 0;      // edi
-    *--task->pStack = (uint32_t) pStackTop; // ebp?
+// Counted by the BSP's PIT, for CPU quota and deadline periods
+static volatile uint32_t nTicks = 0;
 
-    // Segment registers
-    *--task->pStack = 0x23; // ds
-    *--task->pStack = 0x23; // fs
-    *--task->pStack = 0x23; // es
-    *--task->pStack = 0x23; // gs
+// Tasks sleeping with a timeout, soonest first
+static Task* pSleepingTasks = nullptr;
 
-    // SSE, x87 FPU and MMX states - 512 bytes
-    for (unsigned int i = 0; i < 512/sizeof(uint32_t); ++i) *--task->pStack = 0;
+// Tasks waiting on a futex, guarded by the scheduler
+static Task* pFutexWaiters[FUTEX_BUCKETS];
 
-    // Linked list stuff
-    Task* oldHead = pTaskListHead;
-    pTaskListHead = task;
-    task->pPrevTask = oldHead;
-    oldHead->pNextTask = task;
-    
-    if (pTaskListTail == nullptr) pTaskListTail = task;
-    if (task->pNextTask == nullptr) task->pNextTask = pTaskListTail;
+// Shared memory, and every process's handles to it, guarded by a lock taken on its own
+static SharedRegion sharedRegions[MAX_SHARED_REGIONS];
+static SpinLock sharedRegionLock;
 
-    nTasks++;
-    processIDCount++;
+// Each topic's subscribers, newest first, and who key presses go to - guarded by taskListLock
+static Task* pSubscribers[N_TOPICS];
+static Task* pKeyboardFocus = nullptr;
 
-    return task;
-}
+// Deadline tasks, and the share of the CPUs they've reserved in 1/1024ths
+static Task* pDeadlineTasks = nullptr;
+static uint32_t deadlineUtilisation = 0;
 
-Task* CreateChildTask(char const* sName, uint32_t entry, uint32_t size, uint32_t location)
+static uint32_t HashName(const char* sName)
 {
-    return CreateTask(sName, entry, size, location, pCurrentTask->processID);
+    // FNV-1a, over at most the length of Task::sName
+    uint32_t hash = 2166136261;
+    for (size_t i = 0; i < sizeof(Task::sName) && sName[i] != '\0'; ++i)
+    {
+        hash ^= (uint8_t)sName[i];
+        hash *= 16777619;
+    }
+    return hash % PROCESS_TABLE_SIZE;
 }
 
-void EnableScheduler()              { bEnableMultitasking = true; asm volatile("sti"); }
-void DisableScheduler()             { bEnableMultitasking = false; }
-
-static void MapNewUserTask(Task* task)
+static Task* FindTask(uint32_t id)
 {
-    // Unmap current task so its memory can't be read or written to accidentally
-    for (uint32_t i = 0; i < lastUserTaskPages; ++i)
-    {
-        DeallocatePage(0x40000000 + i*PAGE_SIZE);
-    } 
+    Task* task = pTasksByID[id % PROCESS_TABLE_SIZE];
+    while (task != nullptr && task->processID != id) task = task->pNextWithID;
+    return task;
+}
 
-    // Setup paging so task begins at 0x40000000
-    for (uint32_t i = 0; i < task->size / PAGE_SIZE; ++i)
+static uint32_t AllocateProcessID()
+{
+    // IDs count up, then wrap and skip any still in use, so
+    // a recently exited process's ID is the last to be reused
+    while (true)
     {
-        AllocatePage(task->location + i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE, USER_PAGE, false);
+        uint32_t id = processIDCount;
+        processIDCount = (processIDCount == MAX_PROCESS_ID) ? 1 : processIDCount + 1;
+        if (FindTask(id) == nullptr) return id;
     }
-
-    lastUserTaskPages = task->size / PAGE_SIZE;
 }
 
-void OnMultitaskPIT()
+static void LinkTask(Task* task)
 {
-    if (nTasks == 0 || !bEnableMultitasking) { bIRQShouldJump = false; return; }
-    
-    // If one task, switch to it if nessecary
-    if (nTasks == 1 && pCurrentTask == nullptr) 
+    // Circular list - head is the newest task, tail the oldest
+    if (pTaskListHead == nullptr)
     {
-        pCurrentTask = pTaskListHead;
-        oldTaskStack = 0;
-        newTaskStack = (uint32_t) &pCurrentTask->pStack;
-        MapNewUserTask(pCurrentTask);
-        bIRQShouldJump = true; // Will tell the following IRQ 0 to switch tasks
+        task->pPrevTask = task;
+        task->pNextTask = task;
+        pTaskListTail = task;
     }
-    else if (nTasks > 1)
+    else
     {
-        // If no task has previously ran, avoid
-        // sullying the non-existent "old task"
-        if (pCurrentTask == nullptr)
-        {
-            pCurrentTask = pTaskListTail;
-            Task* newTask = pCurrentTask;
-
-            while (newTask->bBlocked && nTasks > 1) newTask = newTask->pNextTask;
-
-            oldTaskStack = 0;
-            newTaskStack = (uint32_t) &newTask->pStack;
-            MapNewUserTask(newTask);
-            bIRQShouldJump = true; // Will tell the following IRQ 0 to switch tasks
-        }
+        task->pPrevTask = pTaskListHead;
+        task->pNextTask = pTaskListTail;
+        pTaskListHead->pNextTask = task;
+        pTaskListTail->pPrevTask = task;
+    }
 
-        // Otherwise continue cycling
-        else
-        {
-            Task* oldTask = pCurrentTask;
-            Task* newTask = pCurrentTask->pNextTask;
+    pTaskListHead = task;
+    nTasks++;
 
-            while (newTask->bBlocked && nTasks > 1) newTask = newTask->pNextTask;
+    // Index by process ID
+    Task** ppBucket = &pTasksByID[task->processID % PROCESS_TABLE_SIZE];
+    task->pNextWithID = *ppBucket;
+    *ppBucket = task;
 
-            pCurrentTask = newTask;
-            oldTaskStack = (uint32_t) &oldTask->pStack;
-            newTaskStack = (uint32_t) &newTask->pStack;
-            MapNewUserTask(newTask);
-            bIRQShouldJump = true; // Will tell the following IRQ 0 to switch tasks
-        }
+    // ...and by name, though threads share theirs with the main thread
+    if (task->pProcess == nullptr || task->pProcess == task)
+    {
+        // Appended, so lookups find the oldest process of that name first
+        ppBucket = &pProcessesByName[HashName(task->sName)];
+        while (*ppBucket != nullptr) ppBucket = &(*ppBucket)->pNextWithName;
+        task->pNextWithName = nullptr;
+        *ppBucket = task;
+        task->bNameIndexed = true;
     }
 }
 
-uint32_t GetNumberOfTasks()
+static void UnindexName(Task* task)
 {
-    return nTasks;
+    if (!task->bNameIndexed) return;
+
+    Task** ppBucket = &pProcessesByName[HashName(task->sName)];
+    while (*ppBucket != task) ppBucket = &(*ppBucket)->pNextWithName;
+    *ppBucket = task->pNextWithName;
+    task->bNameIndexed = false;
 }
 
-void TaskExit(Task* task)
+static void UnlinkTask(Task* task)
 {
-    if (task == nullptr) task = pCurrentTask;
-
-    bool bSysexit = false;
-    if (task == pCurrentTask) bSysexit = true;
-
-    // Case 1: There is one element in the list
     if (nTasks == 1)
     {
-        pCurrentTask = nullptr;
         pTaskListHead = nullptr;
         pTaskListTail = nullptr;
     }
-
-    // Case 2: The task is the first one in the list
-    else if (task == pTaskListTail)
+    else
     {
-        pTaskListTail = task->pNextTask;
-        pTaskListHead->pNextTask = pTaskListTail;
+        task->pPrevTask->pNextTask = task->pNextTask;
+        task->pNextTask->pPrevTask = task->pPrevTask;
+        if (task == pTaskListHead) pTaskListHead = task->pPrevTask;
+        if (task == pTaskListTail) pTaskListTail = task->pNextTask;
     }
 
-    // Case 3: The task is the last one in the list
-    else if (task == pTaskListHead)
+    nTasks--;
+
+    Task** ppBucket = &pTasksByID[task->processID % PROCESS_TABLE_SIZE];
+    while (*ppBucket != task) ppBucket = &(*ppBucket)->pNextWithID;
+    *ppBucket = task->pNextWithID;
+
+    UnindexName(task);
+}
+
+// Task list must be locked
+static void SetSubscribed(Task* task, Topic topic, bool subscribe)
+{
+    if (task->bSubscribed[topic] == subscribe) return;
+    task->bSubscribed[topic] = subscribe;
+
+    if (subscribe)
     {
-        pTaskListHead = task->pPrevTask;
-        pTaskListHead->pNextTask = pTaskListTail;
+        task->pNextSubscriber[topic] = pSubscribers[topic];
+        pSubscribers[topic] = task;
     }
-
-    // Case 4: The task lies somewhere in the middle
     else
     {
-        task->pPrevTask->pNextTask = task->pNextTask;
-        task->pNextTask->pPrevTask = task->pPrevTask;
+        Task** ppTask = &pSubscribers[topic];
+        while (*ppTask != task) ppTask = &(*ppTask)->pNextSubscriber[topic];
+        *ppTask = task->pNextSubscriber[topic];
     }
 
-    if (bSysexit) pCurrentTask = nullptr;
+    // The newest subscriber comes to the foreground, handing it back to the one before when it leaves
+    if (topic == TOPIC_KEYBOARD)
+    {
+        if (subscribe) pKeyboardFocus = task;
+        else if (pKeyboardFocus == task) pKeyboardFocus = pSubscribers[TOPIC_KEYBOARD];
+    }
+}
 
-    // Unallocate all memory
-    kfree(task->pOriginalStack, 4096); // stack
-    if (task->size != 0) kfree((void*)task->location, task->size); // memory
-    kfree(task->pEventQueue, sizeof(TaskEventQueue));
-    kfree(task, sizeof(Task)); // task struct
+static void Subscribe(Topic topic, bool subscribe)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    SetSubscribed(GetCurrentTask(), topic, subscribe);
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+}
 
-    // Switch to new task
-    nTasks--;
-    
-    if (bSysexit)
+// Scheduler must be locked
+static void AddSleepingTask(Task* task, uint32_t wakeTick)
+{
+    Task** ppTask = &pSleepingTasks;
+    while (*ppTask != nullptr && (int32_t)((*ppTask)->wakeTick - wakeTick) <= 0) ppTask = &(*ppTask)->pNextSleeping;
+    task->pNextSleeping = *ppTask;
+    *ppTask = task;
+    task->wakeTick = wakeTick;
+    task->bSleeping = true;
+}
+
+// Scheduler must be locked
+static void RemoveSleepingTask(Task* task)
+{
+    if (!task->bSleeping) return;
+
+    Task** ppTask = &pSleepingTasks;
+    while (*ppTask != task) ppTask = &(*ppTask)->pNextSleeping;
+    *ppTask = task->pNextSleeping;
+    task->bSleeping = false;
+}
+
+static uint32_t GetUtilisation(uint32_t runtime, uint32_t period)
+{
+    // Rounded up, in 1/1024ths of a CPU
+    return (uint32_t)(((uint64_t)runtime * 1024 + period - 1) / period);
+}
+
+// Scheduler must be locked
+static void LeaveDeadlineClass(Task* task)
+{
+    if (!task->bDeadline) return;
+
+    Task** ppTask = &pDeadlineTasks;
+    while (*ppTask != task) ppTask = &(*ppTask)->pNextDeadline;
+    *ppTask = task->pNextDeadline;
+
+    deadlineUtilisation -= GetUtilisation(task->runtime, task->period);
+    task->bDeadline = false;
+    task->bWaitingForPeriod = false;
+}
+
+static TaskGroup* HoldGroup(TaskGroup* group)
+{
+    if (group != nullptr) __atomic_add_fetch(&group->nReferences, 1, __ATOMIC_RELAXED);
+    return group;
+}
+
+static void ReleaseGroup(TaskGroup* group)
+{
+    // Last one out frees it, and lets go of the group it's nested in
+    while (group != nullptr && __atomic_sub_fetch(&group->nReferences, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        bSysexitCall = true;
-        OnMultitaskPIT();
+        TaskGroup* parent = group->pParent;
+        kfree(group, sizeof(TaskGroup));
+        group = parent;
     }
 }
 
-void TaskGrow(uint32_t size)
+// Scheduler must be locked
+static void RefillGroup(TaskGroup* group)
 {
-    pCurrentTask->size += size;
-    lastUserTaskPages = pCurrentTask->size / PAGE_SIZE;
+    if ((int32_t)(nTicks - group->periodEnd) < 0) return;
+
+    if (group->quota != 0 && group->used >= group->quota) group->nThrottled++;
+    group->used = 0;
+    group->periodEnd = nTicks + group->period;
 }
 
-TaskEvent* GetNextEvent()
+// Scheduler must be locked
+static bool IsThrottled(Task* task)
 {
-    if (pCurrentTask->pEventQueue->nEvents == 0) return (TaskEvent*)nullptr;
+    // Deadline tasks are only limited by their own runtime
+    if (task->bDeadline) return task->remainingRuntime == 0;
 
-    // Get bottom event
-    memcpy(&pCurrentTask->pEventQueue->returnEventBuffer, &pCurrentTask->pEventQueue->events[0], sizeof(TaskEvent));
-
-    // Shift all events down by one
-    for (uint32_t i = 0; i < pCurrentTask->pEventQueue->nEvents; ++i)
+    // Out of quota, or nested in a group that is
+    for (TaskGroup* group = task->pGroup; group != nullptr; group = group->pParent)
     {
-        memcpy(&pCurrentTask->pEventQueue->events[i], &pCurrentTask->pEventQueue->events[i+1], sizeof(TaskEvent));
+        RefillGroup(group);
+        if (group->quota != 0 && group->used >= group->quota) return true;
     }
+    return false;
+}
+
+static Task* AllocateTask(char const* sName, TaskType type, uint32_t parentID)
+{
+    // Create new task in memory
+    Task* task = (Task*) kmalloc(sizeof(Task), USER_PAGE);
+    task->type = type;
+    task->parentID = parentID;
+    strncpy(task->sName, sName, 32);
+    task->bBlocked = false;
+    task->bExited = false;
+    task->nThreads = 1;
+
+    // Allocate kernel stack - used for every interrupt and syscall from this task
+    uint32_t kernelStack = (uint32_t)kmalloc(KERNEL_STACK_SIZE);
+    task->pOriginalKernelStack = (uint32_t*)kernelStack;
+    task->pKernelStack = (uint32_t*)(kernelStack + KERNEL_STACK_SIZE);
 
-    pCurrentTask->pEventQueue->nEvents--;
+    // Allocate event queue
+    task->pEventQueue = (TaskEventQueue*) kmalloc(sizeof(TaskEventQueue), USER_PAGE, false);
+    task->pEventQueue->head = 0;
+    task->pEventQueue->tail = 0;
+    task->pEventQueue->removed = 0;
 
-    return &pCurrentTask->pEventQueue->returnEventBuffer;
+    return task;
 }
 
-Task* GetTaskWithProcessID(uint32_t id)
+static void Enqueue(CPU* cpu, Task* task)
 {
-    if (id == 0) return (Task*)nullptr;
+    task->pCPU = cpu;
+    task->pNextQueued = nullptr;
+    task->pPrevQueued = cpu->pRunQueueTail;
+    if (cpu->pRunQueueTail != nullptr) cpu->pRunQueueTail->pNextQueued = task;
+    else cpu->pRunQueueHead = task;
+    cpu->pRunQueueTail = task;
+    cpu->nQueued++;
+    task->bQueued = true;
+}
 
-    Task* task = pTaskListTail;
-    unsigned int count = 0;
-    while (count < nTasks)
+static void Dequeue(Task* task)
+{
+    CPU* cpu = task->pCPU;
+    if (task->pPrevQueued != nullptr) task->pPrevQueued->pNextQueued = task->pNextQueued;
+    else cpu->pRunQueueHead = task->pNextQueued;
+    if (task->pNextQueued != nullptr) task->pNextQueued->pPrevQueued = task->pPrevQueued;
+    else cpu->pRunQueueTail = task->pPrevQueued;
+    cpu->nQueued--;
+    task->bQueued = false;
+}
+
+static void WakeTask(Task* task)
+{
+    // If it's still running, SwitchTask will see it's no longer blocked
+    if (task->bZombie || task->bExited) return;
+    task->bBlocked = false;
+    if (task->blockedSince != 0)
     {
-        if (task->processID == id) return task;
-        task = task->pNextTask;
-        count++;
+        task->blockedCycles += ReadTimestampCounter() - task->blockedSince;
+        task->blockedSince = 0;
     }
+    if (!task->bRunning && !task->bQueued) Enqueue(task->pCPU, task);
+}
+
+static void AddTask(Task* task)
+{
+    // Linked list stuff - we may be preempted (see SysLoadProgram)
+    uint32_t flags = SaveAndDisableInterrupts();
+
+    AcquireSpinLock(&taskListLock);
+    task->processID = AllocateProcessID();
+    LinkTask(task);
+    ReleaseSpinLock(&taskListLock);
 
-    return (Task*)nullptr;
+    // Starts out on this CPU, until an idle one steals it
+    AcquireSpinLock(&schedulerLock);
+    Enqueue(GetCPU(), task);
+    ReleaseSpinLock(&schedulerLock);
+
+    RestoreInterrupts(flags);
 }
 
-int PushEvent(Task* task, TaskEvent* event, uint32_t processIDSource)
+static void InitUserThread(Task* task, uint32_t entry, uint32_t arg0, uint32_t arg1)
+{
+    // Allocate user stack
+    uint32_t stack = (uint32_t)kmalloc(4096, USER_PAGE, false);
+    uint32_t* pStackTop = (uint32_t*)(stack + 4096 - 16); // Stack grows downwards
+    task->pOriginalStack = (uint32_t*)stack;
+
+    // Arguments, as if entry had been called (it mustn't return)
+    *--pStackTop = arg1;
+    *--pStackTop = arg0;
+    *--pStackTop = 0;               // return address
+
+    // Allocate FPU state - only loaded once the task uses it
+    task->pFPUState = CreateFPUState();
+
+    // Allocate thread local storage, reached through gs
+    task->pThreadLocalStorage = (uint32_t*)kmalloc(PAGE_SIZE, USER_PAGE, false);
+    task->pThreadLocalStorage[0] = (uint32_t)task->pThreadLocalStorage;
+    task->pThreadLocalStorage[TLS_EVENT_QUEUE] = (uint32_t)task->pEventQueue;
+    task->pThreadLocalStorage[TLS_SYSENTER] = AreFastSyscallsEnabled();
+
+    // Push the frame an IRQ from ring 3 would have left on the kernel stack
+    *--task->pKernelStack = 0x23;   // stack segment (ss)
+    *--task->pKernelStack = (uint32_t) pStackTop; // esp
+    *--task->pKernelStack = 0x202; // eflags - default value with interrupts enabled
+    *--task->pKernelStack = 0x1B;    // cs (iret uses a 32-bit pop - don't panic!)
+    *--task->pKernelStack = entry;  // eip
+    *--task->pKernelStack = 0;      // eax
+    *--task->pKernelStack = 0;      // ebx
+    *--task->pKernelStack = 0;      // ecx
+    *--task->pKernelStack = 0;      // edx
+    *--task->pKernelStack = 0;      // ebp
+    *--task->pKernelStack = 0;      // edi
+    *--task->pKernelStack = 0;      // esi
+
+    // Segment registers
+    *--task->pKernelStack = 0x23; // ds
+    *--task->pKernelStack = 0x23; // es
+    *--task->pKernelStack = 0x23; // fs
+    *--task->pKernelStack = GDT_TLS_SELECTOR; // gs
+
+    // ...then what SwitchContext expects, "returning" into ring 3
+    *--task->pKernelStack = (uint32_t) &ReturnToUserTask;
+    *--task->pKernelStack = 0;      // ebp
+    *--task->pKernelStack = 0;      // ebx
+    *--task->pKernelStack = 0;      // esi
+    *--task->pKernelStack = 0;      // edi
+}
+
+static void InheritPipeEnd(Task* task, uint32_t slot, Task* parent, uint32_t end, bool bWrite);
+static void ClosePipeEnds(Task* process);
+static void UnmapSharedRegions(Task* process);
+
+Task* CreateTask(char const* sName, uint32_t entry, uint32_t size, uint32_t location, uint32_t parentID,
+                 uint32_t stdinEnd, uint32_t stdoutEnd)
 {
-    // Check event queue is not full
-    if (task->pEventQueue->nEvents >= MAX_TASK_EVENTS-1) return -1;
+    Task* task = AllocateTask(sName, USER_TASK, parentID);
+    task->pProcess = task;
+    task->bMainThread = true;
+
+    // Shares the CPU quota of its parent's children, else its parent's own
+    Task* pParentRef = GetTaskWithProcessID(parentID);
+    Task* parent = (pParentRef != nullptr) ? pParentRef->pProcess : (Task*)nullptr;
+    if (parent != nullptr) task->pGroup = HoldGroup(parent->pChildGroup != nullptr ? parent->pChildGroup : parent->pGroup);
+
+    // Given its own ends of any of its parent's pipes as stdin and stdout, before it can write anything
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&eventLock);
+    InheritPipeEnd(task, PIPE_STDIN, parent, stdinEnd, false);
+    InheritPipeEnd(task, PIPE_STDOUT, parent, stdoutEnd, true);
+    ReleaseSpinLock(&eventLock);
+    RestoreInterrupts(flags);
+    if (pParentRef != nullptr) ReleaseTask(pParentRef);
 
-    // Push event
-    memcpy(&task->pEventQueue->events[task->pEventQueue->nEvents], event, sizeof(TaskEvent));
-    task->pEventQueue->events[task->pEventQueue->nEvents].source = processIDSource;
-    task->pEventQueue->nEvents++;
+    // Round task to nearest page
+    uint32_t originalSize = size;
+    uint32_t roundedSize = originalSize;
+    uint32_t remainder = roundedSize % PAGE_SIZE;
+    if (remainder != 0) roundedSize += PAGE_SIZE - remainder;
+    task->size = roundedSize;
+    task->location = location;
 
-    // Unblock process
-    if (task->blockedEvent == 0 || event->id == task->blockedEvent) task->bBlocked = false;
+    InitUserThread(task, entry, 0, 0);
 
-    return 0;
+    AddTask(task);
+    return task;
 }
 
-int PushEvent(Task* task, TaskEvent* event)
+Task* CreateThread(uint32_t entry, uint32_t arg0, uint32_t arg1)
+{
+    // Shares the memory of the calling thread's process, but nothing else
+    Task* process = GetCurrentTask()->pProcess;
+    Task* task = AllocateTask(process->sName, USER_TASK, process->parentID);
+    task->pProcess = process;
+    task->pGroup = HoldGroup(process->pGroup);
+    task->size = 0;
+    task->location = 0;
+
+    // The process, and its memory, outlast it until it's been reaped too (see FreeTaskResources)
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    process->nThreads++;
+    process->nReferences++;
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    InitUserThread(task, entry, arg0, arg1);
+
+    AddTask(task);
+    return task;
+}
+
+void OnTaskStart()
 {
-    return PushEvent(task, event, pCurrentTask->processID);
+    ReleaseSpinLock(&schedulerLock);
 }
 
-int PopLastEvent(uint32_t event)
+static void KernelTaskStart(void (*entry)())
+{
+    // SwitchContext got here with interrupts off
+    OnTaskStart();
+    EnableInterrupts();
+    entry();
+    TaskExit();
+}
+
+Task* CreateKernelTask(char const* sName, void (*entry)())
+{
+    // Ring 0 - no user stack, memory or FPU state of its own
+    Task* task = AllocateTask(sName, KERNEL_TASK, 0);
+    task->bPreemptible = true;
+
+    // What SwitchContext expects, "returning" into KernelTaskStart(entry)
+    *--task->pKernelStack = (uint32_t) entry;
+    *--task->pKernelStack = 0;      // KernelTaskStart never returns
+    *--task->pKernelStack = (uint32_t) &KernelTaskStart;
+    *--task->pKernelStack = 0;      // ebp
+    *--task->pKernelStack = 0;      // ebx
+    *--task->pKernelStack = 0;      // esi
+    *--task->pKernelStack = 0;      // edi
+
+    AddTask(task);
+    return task;
+}
+
+Task* CreateChildTask(char const* sName, uint32_t entry, uint32_t size, uint32_t location, uint32_t stdinEnd, uint32_t stdoutEnd)
+{
+    // Whichever thread asked, the child belongs to the whole process
+    return CreateTask(sName, entry, size, location, GetCurrentTask()->pProcess->processID, stdinEnd, stdoutEnd);
+}
+
+void EnableScheduler()              { bEnableMultitasking = true; asm volatile("sti"); }
+void DisableScheduler()             { bEnableMultitasking = false; }
+
+static void MapNewUserTask(CPU* cpu, Task* task)
+{
+    // Threads of the same process see the same memory
+    task = task->pProcess;
+    if (task == cpu->pMappedProcess) return;
+    cpu->pMappedProcess = task;
+
+    // Setup paging so task begins at 0x40000000, unmapping the last
+    // one so its memory can't be read or written to accidentally
+    uint32_t nPages = task->size / PAGE_SIZE;
+    if (nPages > USER_WINDOW_DIRECTORIES * 1024) nPages = USER_WINDOW_DIRECTORIES * 1024;
+    MapUserWindow(cpu->pUserWindow, task->location, nPages, cpu->nMappedPages);
+    cpu->nMappedPages = nPages;
+}
+
+static void LazyFPUSwitch(CPU* cpu, Task* task)
 {
-    if (pCurrentTask->pEventQueue->nEvents == 0) return -1;
+    // Only trap on the first FPU or SSE instruction if another task's state is loaded
+    if (task == cpu->pFPUOwner) ClearTaskSwitched();
+    else SetTaskSwitched();
+}
 
-    // Find first  event in question
-    for (uint32_t i = 0; i < pCurrentTask->pEventQueue->nEvents; ++i)
+static void FreeTaskResources(Task* task)
+{
+    // Unallocate all memory, but what a zombie needs
+    if (task->type == USER_TASK)
     {
-        if (pCurrentTask->pEventQueue->events[i].id == event)
-        {
-            // Shift next events down by one
-            for (uint32_t j = i; j < pCurrentTask->pEventQueue->nEvents; ++j)
-            {
-                memcpy(&pCurrentTask->pEventQueue->events[j], &pCurrentTask->pEventQueue->events[j+1], sizeof(TaskEvent));
-            }
-            
-            pCurrentTask->pEventQueue->nEvents--;
-            return 0;
-        }
+        kfree(task->pOriginalStack, 4096); // stack
+        kfree(task->pThreadLocalStorage, PAGE_SIZE);
+        FreeFPUState(task->pFPUState);
+        if (task->pSyscallRing != nullptr) kfree(task->pSyscallRing, sizeof(SyscallRing));
+    }
+    kfree(task->pOriginalKernelStack, KERNEL_STACK_SIZE); // kernel stack
+    ReleaseGroup(task->pGroup);
+    ReleaseGroup(task->pChildGroup);
+
+    // Threads killed on other CPUs run on until they next enter the kernel (see ExitProcess),
+    // so what they share goes with whichever is reaped last, by when none of them can be running
+    Task* process = (task->pProcess != nullptr) ? task->pProcess : task;
+    if (__atomic_sub_fetch(&process->nThreads, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if (process->type == USER_TASK) ClosePipeEnds(process);
+        if (process->type == USER_TASK) UnmapSharedRegions(process);
+        if (process->size != 0) kfree((void*)process->location, process->size); // memory
     }
+    if (process != task) ReleaseTask(process);
+}
 
-    return -1;
+static inline Task* GetCurrentProcess()
+{
+    Task* task = GetCurrentTask();
+    return (task->pProcess != nullptr) ? task->pProcess : task;
 }
 
-void SubscribeToStdout(bool subscribe)
+static inline uint32_t EventSlot(uint32_t index) { return index & (MAX_TASK_EVENTS - 1); }
+
+static inline bool IsEventRemoved(TaskEventQueue* pQueue, uint32_t index)
 {
-    pCurrentTask->bSubscribeToStdout = subscribe;
+    return (pQueue->removed >> EventSlot(index)) & 1;
 }
 
-void OnStdout(const char* message)
+// Event queue must be locked. The grants of events passed over are the task's own now
+static void AdvanceEventHead(Task* task, uint32_t head)
 {
-    // Walk up process tree before a subscriber of stdout is found
-    Task* task = GetTaskWithProcessID(pCurrentTask->parentID);
-    bool bFound = false;
+    for (; task->eventHead != head; ++task->eventHead) task->eventGrants[EventSlot(task->eventHead)] = 0;
+}
 
-    while (task != nullptr)
-    {
-        if (task->bSubscribeToStdout && !bFound)
-        {
-            // Found subscriber, dispatch events in the form of 31 chars at a time (plus null terminator)
-            for (uint32_t i = 0; i < strlen(message); i+=31)
-            {
-                TaskEvent event;
-                
-                event.id = EVENT_QUEUE_PRINTF;
-                for (uint32_t c = 0; c < 31; ++c)
-                {
-                    event.data[c] = message[i+c];
-                    if (message[i+c] == '\0') break; // Break if null terminator
-                }
-                event.data[31] = '\0';
-
-                PushEvent(task, &event);
-            }
+// Event queue must be locked. Only followed forwards, and no further than we've pushed, so
+// whatever the task writes there, nothing from head to tail is more than a queue's worth
+static uint32_t SyncEventHead(Task* task)
+{
+    uint32_t head = __atomic_load_n(&task->pEventQueue->head, __ATOMIC_ACQUIRE);
+    if (head - task->eventHead <= task->eventTail - task->eventHead) AdvanceEventHead(task, head);
+    return task->eventHead;
+}
 
-            bFound = true;
-        }
-        task = GetTaskWithProcessID(task->parentID);
-    }
+static inline uint32_t GrantSize(const TaskEvent* event)
+{
+    return (event->length + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
 
-    // Else, just print to kernel screen
-    if (!bFound) VGA_printf(message, false);
+static void FreeTaskStruct(Task* task)
+{
+    // Events may still be pushed to a zombie, and its stdout read - along with grants nobody took
+    SyncEventHead(task);
+    for (uint32_t i = 0; i < MAX_TASK_EVENTS; ++i)
+    {
+        if (task->eventGrants[i] != 0) kfree((void*)task->eventGrants[i], task->eventGrantSizes[i]);
+    }
+    kfree(task->pEventQueue, sizeof(TaskEventQueue));
+    if (task->pStdout != nullptr)
+    {
+        kfree(task->pStdout->pBuffer, STDOUT_BUFFER_SIZE);
+        kfree(task->pStdout, sizeof(Stream));
+    }
+    kfree(task, sizeof(Task)); // task struct
 }
 
-void OnStdout(uint32_t data, bool hex)
+// Once it's unlinked, so no lookup can find it any more - it still has to outlast those that already did
+static void DropTaskStruct(Task* task)
 {
-    // Get number of digits
-    size_t i = data;
-    size_t nDigits = 1;
-    while (i/=(hex ? 16 : 10)) nDigits++;
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    task->bUnreferenced = true;
+    bool bFree = task->nReferences == 0;
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    if (bFree) FreeTaskStruct(task);
+}
 
-    auto digitToASCII = [](const size_t number) { return (char)('0' + number); };
-    auto hexToASCII = [](const size_t number) 
+// Both the task list and scheduler must be locked
+static void WakeWaitersForChild(uint32_t parentID)
+{
+    Task* task = pTaskListTail;
+    for (size_t i = 0; i < nTasks; ++i, task = task->pNextTask)
     {
-        char value = number % 16 + 48;
-        if (value > 57) value += 7;
-        return value;
-    };
-    auto getNthDigit = [](const size_t number, const size_t digit, const size_t base) { return int((number / pow(base, digit)) % base); };
-   
-    if (hex) OnStdout("0x");
+        if (!task->bWaitingForChild || task->pProcess->processID != parentID) continue;
+        task->bWaitingForChild = false;
+        WakeTask(task);
+    }
+}
 
-    char buffer[2];
-    buffer[1] = '\0';
+static void SwitchTask(Task* pHandoff = nullptr);
 
-    if (hex) 
-    { 
-        for (size_t d = 0; d < nDigits; ++d) 
+static void Reaper()
+{
+    // Frees exited tasks - by the time we can lock the scheduler, none of them can still be on its kernel stack
+    while (true)
+    {
+        uint32_t flags = SaveAndDisableInterrupts();
+        AcquireSpinLock(&schedulerLock);
+        Task* task = pDeadTasks;
+        pDeadTasks = nullptr;
+
+        // Sleep until TaskExit gives us more
+        if (task == nullptr)
         {
-            buffer[0] = (hexToASCII(getNthDigit(data, nDigits - d - 1, 16)));
-            OnStdout(buffer);
+            GetCurrentTask()->bBlocked = true;
+            SwitchTask();
         }
-    }
-    else
-    {
-        for (size_t d = 0; d < nDigits; ++d) 
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+
+        while (task != nullptr)
         {
-            buffer[0] = (digitToASCII(getNthDigit(data, nDigits - d - 1, 10)));
-            OnStdout(buffer);
+            Task* next = task->pNextDead;
+            if (!task->bReleased) FreeTaskResources(task);
+
+            flags = SaveAndDisableInterrupts();
+            AcquireSpinLock(&taskListLock);
+            AcquireSpinLock(&schedulerLock);
+
+            // Processes leave their struct and exit code behind for their parent to wait
+            // for, unless orphaned, in which case there's nobody left to collect them
+            bool bKeep = task->bZombie && task->parentID != 0;
+            if (bKeep)
+            {
+                task->bReleased = true;
+                WakeWaitersForChild(task->parentID);
+            }
+            else if (task->bZombie) UnlinkTask(task);
+
+            ReleaseSpinLock(&schedulerLock);
+            ReleaseSpinLock(&taskListLock);
+            RestoreInterrupts(flags);
+
+            if (!bKeep) DropTaskStruct(task);
+            task = next;
         }
     }
 }
 
-void SubscribeToSysexit(bool subscribe)
+void InitMultitasking()
 {
-    pCurrentTask->bSubscribeToSysexit = subscribe;
+    pReaperTask = CreateKernelTask("reaper", &Reaper);
 }
 
-void OnSysexit(uint32_t exitingProcessID)
+static Task* StealTask(CPU* cpu)
 {
-    // Walk up process tree before a subscriber of sysexit is found
-    Task* task = GetTaskWithProcessID(GetTaskWithProcessID(exitingProcessID)->parentID);
+    // Take from the back of the longest queue, but not a task
+    // whose FPU state is still loaded on the CPU it's waiting for
+    CPU* pVictim = nullptr;
+    for (uint32_t i = 0; i < nCPUs; ++i)
+    {
+        if (&cpus[i] == cpu || cpus[i].nQueued == 0) continue;
+        if (pVictim == nullptr || cpus[i].nQueued > pVictim->nQueued) pVictim = &cpus[i];
+    }
+    if (pVictim == nullptr) return nullptr;
 
-    while (task != nullptr)
+    for (Task* task = pVictim->pRunQueueTail; task != nullptr; task = task->pPrevQueued)
     {
-        if (task->bSubscribeToSysexit)
-        {
-            // Found subscriber, dispatch event
-            TaskEvent event;     
-            event.id = EVENT_QUEUE_SYSEXIT;
-            PushEvent(task, &event, exitingProcessID);
-        }
-        task = GetTaskWithProcessID(task->parentID);
+        if (task == pVictim->pFPUOwner || IsThrottled(task)) continue;
+        Dequeue(task);
+        return task;
     }
+
+    return nullptr;
 }
 
-void OnSysexit()
+static Task* GetNextDeadlineTask(CPU* cpu)
 {
-    OnSysexit(pCurrentTask->processID);
+    // From any CPU's queue, as long as it has runtime left this period
+    Task* pEarliest = nullptr;
+    for (Task* task = pDeadlineTasks; task != nullptr; task = task->pNextDeadline)
+    {
+        if (!task->bQueued || task->remainingRuntime == 0) continue;
+        if (task->pCPU != cpu && task == task->pCPU->pFPUOwner) continue;
+        if (pEarliest == nullptr || (int32_t)(task->absoluteDeadline - pEarliest->absoluteDeadline) < 0) pEarliest = task;
+    }
+
+    if (pEarliest != nullptr) Dequeue(pEarliest);
+    return pEarliest;
 }
 
-void SubscribeToKeyboard(bool subscribe)
+static Task* GetNextRunnableTask(CPU* cpu)
 {
-    pCurrentTask->bSubscribeToKeyboard = subscribe;
+    // Deadline tasks come first
+    Task* pDeadlineTask = GetNextDeadlineTask(cpu);
+    if (pDeadlineTask != nullptr) return pDeadlineTask;
+
+    // Round robin through our own queue, passing over anything out of CPU quota
+    for (Task* task = cpu->pRunQueueHead; task != nullptr; task = task->pNextQueued)
+    {
+        if (IsThrottled(task)) continue;
+        Dequeue(task);
+        return task;
+    }
+
+    // ...else help out another CPU, or idle if there's nothing (null) to run
+    return StealTask(cpu);
 }
 
-void OnKeyEvent(char key, bool bSpecial)
+// Scheduler must be locked, and stays locked for whatever we switch to
+static void SwitchTask(Task* pHandoff)
 {
-    // Walk through each task and sent event if applicable
-    unsigned int count = 0;
-    Task* task = pTaskListTail;
-    while (task != nullptr && count < nTasks)
+    CPU* cpu = GetCPU();
+    Task* oldTask = cpu->pCurrentTask;
+
+    // Still runnable, so to the back of the queue
+    if (oldTask != nullptr && !oldTask->bBlocked && !oldTask->bExited) Enqueue(cpu, oldTask);
+
+    // Straight to a task we've just woken (see IPCCall), if it's free to run here, else whoever's next
+    Task* newTask;
+    if (pHandoff != nullptr && pHandoff->bQueued && !IsThrottled(pHandoff) &&
+        (pHandoff->pCPU == cpu || pHandoff != pHandoff->pCPU->pFPUOwner))
     {
-        if (task->bSubscribeToKeyboard)
+        Dequeue(pHandoff);
+        newTask = pHandoff;
+    }
+    else newTask = GetNextRunnableTask(cpu);
+    if (newTask == oldTask) return;
+
+    uint64_t now = ReadTimestampCounter();
+    if (oldTask != nullptr)
+    {
+        oldTask->runCycles += now - oldTask->switchedInAt;
+        if (oldTask->bBlocked) oldTask->blockedSince = now;
+
+        // Other CPUs can only take it once the scheduler's unlocked, by when SwitchContext has saved it
+        oldTask->bRunning = false;
+
+        // ...but they can't reach our FPU registers
+        if (oldTask->bQueued && oldTask == cpu->pFPUOwner && nCPUs > 1)
         {
-            TaskEvent event;
-            event.id = EVENT_QUEUE_KEY_PRESS;
-            event.data[0] = key;
-            event.data[1] = bSpecial;
-            PushEvent(task, &event);
+            SaveFPUState(oldTask->pFPUState);
+            cpu->pFPUOwner = nullptr;
         }
+    }
+
+    uint32_t** ppOldStack = (oldTask == nullptr) ? &cpu->pIdleStack : &oldTask->pKernelStack;
+    uint32_t* pNewStack = (newTask == nullptr) ? cpu->pIdleStack : newTask->pKernelStack;
 
-        task = task->pNextTask;
-        ++count;
+    cpu->pCurrentTask = newTask;
+    if (newTask != nullptr)
+    {
+        newTask->bRunning = true;
+        newTask->pCPU = cpu;
+        newTask->switchedInAt = now;
+        newTask->nSwitches++;
+
+        // Ring 3 -> 0 transitions of the new task land on its own kernel stack
+        // (kernel tasks never leave ring 0, and don't care what's mapped at 0x40000000)
+        if (newTask->type == USER_TASK)
+        {
+            cpu->tss.esp0 = (uint32_t)newTask->pOriginalKernelStack + KERNEL_STACK_SIZE;
+            SetThreadLocalStorage((uint32_t)newTask->pThreadLocalStorage);
+            MapNewUserTask(cpu, newTask);
+        }
     }
+    LazyFPUSwitch(cpu, newTask);
+
+    // Returns once something switches back to us, perhaps on another CPU
+    SwitchContext(ppOldStack, pNewStack);
 }
 
-void KillTask(Task* task)
+void Schedule()
 {
-    TaskExit(task);
+    if (!bEnableMultitasking) return;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+    SwitchTask();
+    ReleaseSpinLock(&schedulerLock);
+
+    RestoreInterrupts(flags);
 }
 
-void OnProcessBlock(uint32_t event)
+static void ChargeTick()
 {
-    pCurrentTask->bBlocked = true;
-    pCurrentTask->blockedEvent = event;
-    OnMultitaskPIT();
+    Task* task = GetCurrentTask();
+    if (task == nullptr) return;
+
+    // Throttled tasks are passed over by the Schedule() that follows
+    AcquireSpinLock(&schedulerLock);
+    if (task->bDeadline && task->remainingRuntime > 0) task->remainingRuntime--;
+    for (TaskGroup* group = task->pGroup; group != nullptr; group = group->pParent)
+    {
+        RefillGroup(group);
+        group->used++;
+    }
+    ReleaseSpinLock(&schedulerLock);
+}
+
+static void ReleaseDeadlineJobs()
+{
+    AcquireSpinLock(&schedulerLock);
+
+    for (Task* task = pDeadlineTasks; task != nullptr; task = task->pNextDeadline)
+    {
+        if ((int32_t)(nTicks - task->nextRelease) < 0) continue;
+
+        // Never finished the last one
+        if (!task->bJobDone) task->nDeadlineMisses++;
+
+        task->bJobDone = false;
+        task->remainingRuntime = task->runtime;
+        task->absoluteDeadline = task->nextRelease + task->relativeDeadline;
+        task->nextRelease += task->period;
+        if (task->bWaitingForPeriod)
+        {
+            task->bWaitingForPeriod = false;
+            WakeTask(task);
+        }
+    }
+
+    ReleaseSpinLock(&schedulerLock);
+}
+
+static void WakeSleepingTasks()
+{
+    AcquireSpinLock(&schedulerLock);
+
+    // Soonest first, so stop at the first still asleep
+    while (pSleepingTasks != nullptr && (int32_t)(nTicks - pSleepingTasks->wakeTick) >= 0)
+    {
+        Task* task = pSleepingTasks;
+        RemoveSleepingTask(task);
+        WakeTask(task);
+    }
+
+    ReleaseSpinLock(&schedulerLock);
+}
+
+// Killed from another CPU whilst running here (see TaskExit). Only as an interrupt returns, never
+// from Schedule, which kernel code calls halfway through things (see AcquireLock) - syscalls run
+// with interrupts off, but for preemptible sections, which EndPreemptibleSection exits from instead
+static void ExitIfKilled()
+{
+    Task* task = GetCurrentTask();
+    if (task != nullptr && task->bKillPending && !task->bPreemptible) TaskExit();
+}
+
+void OnMultitaskPIT()
+{
+    // Only the BSP has the PIT - other CPUs get here from their APIC timers
+    if (GetCPU()->id == 0)
+    {
+        nTicks++;
+        if (bEnableMultitasking) { ReleaseDeadlineJobs(); WakeSleepingTasks(); }
+    }
+
+    if (bEnableMultitasking) ChargeTick();
+    ExitIfKilled();
+    Schedule();
+}
+
+void OnRescheduleIPI()
+{
+    ExitIfKilled();
+    Schedule();
+}
+
+uint32_t GetNumberOfTasks()
+{
+    return nTasks;
+}
+
+// Both the task list and scheduler must be locked
+static void OrphanChildren(Task* process)
+{
+    // Nobody's left to wait for them, so zombies go to the reaper
+    Task* task = pTaskListTail;
+    for (size_t i = 0; i < nTasks; ++i, task = task->pNextTask)
+    {
+        if (task->parentID != process->processID) continue;
+        task->parentID = 0;
+
+        // ...or are there already, and it'll see they're orphans
+        if (task->bZombie && task->bReleased)
+        {
+            task->pNextDead = pDeadTasks;
+            pDeadTasks = task;
+            if (pReaperTask != nullptr) WakeTask(pReaperTask);
+        }
+    }
+}
+
+static void AbortIPC(Task* task);
+static void RemoveFutexWaiter(Task* task);
+
+void TaskExit(Task* task)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    Task* current = GetCurrentTask();
+    if (task == nullptr) task = current;
+
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&schedulerLock);
+
+    // Running on another CPU - it'll exit itself when it next enters the kernel, which we hurry along
+    if (task->bExited || (task->bRunning && task != current))
+    {
+        bool bRemote = !task->bExited;
+        if (bRemote) task->bKillPending = true;
+        ReleaseSpinLock(&schedulerLock);
+        ReleaseSpinLock(&taskListLock);
+        if (bRemote) SendIPI(task->pCPU->apicID, APIC_RESCHEDULE_VECTOR);
+        RestoreInterrupts(flags);
+        return;
+    }
+
+    AbortIPC(task);
+    for (uint32_t i = 0; i < N_TOPICS; ++i) SetSubscribed(task, (Topic)i, false);
+
+    // Processes stay linked as zombies, with their exit code, until their parent waits for them
+    bool bZombie = task->bMainThread && task->parentID != 0 && FindTask(task->parentID) != nullptr;
+    if (bZombie) UnindexName(task);
+    else UnlinkTask(task);
+    if (task->bMainThread) OrphanChildren(task);
+    ReleaseSpinLock(&taskListLock);
+
+    if (task->bQueued) Dequeue(task);
+    LeaveDeadlineClass(task);
+    RemoveSleepingTask(task);
+    RemoveFutexWaiter(task);
+    task->bExited = true;
+    task->bZombie = bZombie; // (threads which were zombies don't wait for anything any more)
+    task->bWaitingForChild = false;
+    for (uint32_t i = 0; i < nCPUs; ++i)
+    {
+        if (cpus[i].pFPUOwner == task) cpus[i].pFPUOwner = nullptr;
+        if (cpus[i].pMappedProcess == task) cpus[i].pMappedProcess = nullptr; // its struct may be reused
+    }
+
+    // Freeing takes a while, so leave it to the reaper - which has to anyway if
+    // we're still on our own kernel stack, until we've switched off it
+    task->pNextDead = pDeadTasks;
+    pDeadTasks = task;
+    if (pReaperTask != nullptr) WakeTask(pReaperTask);
+
+    if (task != current)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+        return;
+    }
+
+    SwitchTask(); // never returns
+}
+
+void ExitProcess(Task* task, uint32_t exitCode)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    Task* current = GetCurrentTask();
+    if (task == nullptr) task = current;
+    Task* process = task->pProcess;
+    if (!process->bExited) process->exitCode = exitCode;
+
+    // Every other thread goes first, as TaskExit won't return for the current one
+    while (true)
+    {
+        AcquireSpinLock(&taskListLock);
+        Task* thread = pTaskListTail;
+        Task* pVictim = nullptr;
+        for (size_t i = 0; i < nTasks && pVictim == nullptr; ++i, thread = thread->pNextTask)
+        {
+            // Those already marked dying exit themselves, unless they've since gone to sleep
+            bool bDying = thread->bKillPending && (thread->bRunning || thread->bPreemptible);
+            if (thread->pProcess == process && thread != current && !thread->bExited && !bDying) pVictim = thread;
+        }
+
+        // Preempted mid-syscall (see KillTask), so marked dying like those on other CPUs - the
+        // process's memory stays until they've all left (see FreeTaskResources)
+        bool bDeferred = pVictim != nullptr && pVictim->bPreemptible;
+        if (bDeferred) pVictim->bKillPending = true;
+        ReleaseSpinLock(&taskListLock);
+
+        if (pVictim == nullptr) break;
+        if (!bDeferred) TaskExit(pVictim);
+    }
+
+    if (current != nullptr && current->pProcess == process) TaskExit();
+    RestoreInterrupts(flags);
+}
+
+int JoinThread(Task* thread)
+{
+    Task* current = GetCurrentTask();
+    if (thread == current || thread->pProcess != current->pProcess || thread->pProcess == thread) return -1;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    // Only one joiner, as it's the one that frees the thread
+    if (thread->pJoiner != nullptr || thread->bExited)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+        return -1;
+    }
+    thread->pJoiner = current;
+
+    // Sleep until ThreadExit wakes us
+    while (!thread->bZombie)
+    {
+        current->bBlocked = true;
+        current->blockedEvent = 0;
+        SwitchTask();
+    }
+    ReleaseSpinLock(&schedulerLock);
+
+    int exitCode = (int)thread->exitCode;
+    TaskExit(thread);
+
+    RestoreInterrupts(flags);
+    return exitCode;
+}
+
+void ThreadExit(uint32_t exitCode)
+{
+    // The main thread takes the whole process with it
+    Task* current = GetCurrentTask();
+    if (current->pProcess == current)
+    {
+        OnSysexit(exitCode);
+        ExitProcess(nullptr, exitCode);
+        return;
+    }
+
+    DisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    // Stay in the list, never to be scheduled again, until joined
+    current->exitCode = exitCode;
+    current->bZombie = true;
+    current->bBlocked = true;
+    LeaveDeadlineClass(current);
+    if (current->pJoiner != nullptr) WakeTask(current->pJoiner);
+
+    SwitchTask(); // never returns
+}
+
+void TaskGrow(uint32_t size)
+{
+    Task* process = GetCurrentTask()->pProcess;
+    process->size += size;
+}
+
+// Consumer side of the queue, which only the task itself may be - in or out of the kernel (see pollEvents)
+static uint32_t ConsumeEvents(Task* task, TaskEvent* pEvents, uint32_t maxEvents)
+{
+    TaskEventQueue* pQueue = task->pEventQueue;
+    uint32_t head = SyncEventHead(task);
+    uint32_t tail = task->eventTail;
+
+    // Passing over (and freeing) any slots PopLastEvent removed
+    uint32_t nEvents = 0;
+    for (; head != tail && nEvents < maxEvents; ++head)
+    {
+        uint64_t bit = 1ull << EventSlot(head);
+        if (pQueue->removed & bit) { pQueue->removed &= ~bit; continue; }
+        memcpy(&pEvents[nEvents++], &pQueue->events[EventSlot(head)], sizeof(TaskEvent));
+    }
+
+    // Only now can PushEvent reuse the slots
+    AdvanceEventHead(task, head);
+    __atomic_store_n(&pQueue->head, head, __ATOMIC_RELEASE);
+    return nEvents;
+}
+
+TaskEvent* GetNextEvent()
+{
+    Task* task = GetCurrentTask();
+    TaskEventQueue* pQueue = task->pEventQueue;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&eventLock);
+
+    // Get bottom event
+    uint32_t nEvents = ConsumeEvents(task, &pQueue->returnEventBuffer, 1);
+
+    ReleaseSpinLock(&eventLock);
+    RestoreInterrupts(flags);
+
+    return (nEvents == 0) ? (TaskEvent*)nullptr : &pQueue->returnEventBuffer;
+}
+
+int GetEvents(TaskEvent* pEvents, uint32_t maxEvents, uint32_t timeout)
+{
+    Task* task = GetCurrentTask();
+    uint32_t wakeTick = nTicks + timeout;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    while (true)
+    {
+        AcquireSpinLock(&eventLock);
+
+        // As many as we can in one go
+        uint32_t nEvents = ConsumeEvents(task, pEvents, maxEvents);
+
+        bool bTimedOut = timeout != WAIT_FOREVER && (int32_t)(nTicks - wakeTick) >= 0;
+        if (nEvents > 0 || timeout == 0 || bTimedOut || maxEvents == 0)
+        {
+            ReleaseSpinLock(&eventLock);
+            RestoreInterrupts(flags);
+            return (int)nEvents;
+        }
+
+        // Block before letting go of the queue, so PushEvent can't wake us too early
+        AcquireSpinLock(&schedulerLock);
+        ReleaseSpinLock(&eventLock);
+        task->bBlocked = true;
+        task->blockedEvent = 0;
+        if (timeout != WAIT_FOREVER) AddSleepingTask(task, wakeTick);
+        SwitchTask();
+
+        // Woken by an event, or the timeout
+        RemoveSleepingTask(task);
+        ReleaseSpinLock(&schedulerLock);
+    }
+}
+
+// Event queue must be locked
+static uint32_t FindQueuedEvent(Task* task, const uint32_t* pIDs, uint32_t nIDs)
+{
+    // Oldest first, without consuming it
+    TaskEventQueue* pQueue = task->pEventQueue;
+    for (uint32_t i = SyncEventHead(task); i != task->eventTail; ++i)
+    {
+        if (IsEventRemoved(pQueue, i)) continue;
+
+        uint32_t id = pQueue->events[EventSlot(i)].id;
+        if (nIDs == 0) return id;
+        for (uint32_t j = 0; j < nIDs; ++j)
+        {
+            if (pIDs[j] == id) return id;
+        }
+    }
+    return WAIT_TIMED_OUT;
+}
+
+uint32_t WaitEvents(const uint32_t* pIDs, uint32_t nIDs, uint32_t timeout)
+{
+    Task* task = GetCurrentTask();
+    uint32_t wakeTick = nTicks + timeout;
+    if (nIDs > MAX_WAIT_EVENTS) nIDs = MAX_WAIT_EVENTS;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    while (true)
+    {
+        AcquireSpinLock(&eventLock);
+
+        // Left queued, for the caller to handle however it likes
+        uint32_t id = FindQueuedEvent(task, pIDs, nIDs);
+
+        bool bTimedOut = timeout != WAIT_FOREVER && (int32_t)(nTicks - wakeTick) >= 0;
+        if (id != WAIT_TIMED_OUT || timeout == 0 || bTimedOut)
+        {
+            ReleaseSpinLock(&eventLock);
+            RestoreInterrupts(flags);
+            return id;
+        }
+
+        // Block before letting go of the queue, so PushEvent can't wake us too early
+        AcquireSpinLock(&schedulerLock);
+        ReleaseSpinLock(&eventLock);
+        for (uint32_t i = 0; i < nIDs; ++i) task->waitIDs[i] = pIDs[i];
+        task->nWaitIDs = nIDs;
+        task->bBlocked = true;
+        task->blockedEvent = 0;
+        if (timeout != WAIT_FOREVER) AddSleepingTask(task, wakeTick);
+        SwitchTask();
+
+        // Woken by one of them, or the timeout
+        RemoveSleepingTask(task);
+        task->nWaitIDs = 0;
+        ReleaseSpinLock(&schedulerLock);
+    }
+}
+
+// Held until ReleaseTask, as it may exit and be reaped meanwhile on another CPU
+Task* GetTaskWithProcessID(uint32_t id)
+{
+    if (id == 0) return (Task*)nullptr;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    Task* task = FindTask(id);
+    if (task != nullptr) task->nReferences++;
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    return task;
+}
+
+void ReleaseTask(Task* task)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    bool bFree = --task->nReferences == 0 && task->bUnreferenced;
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    // The reaper or a waiting parent already dropped it
+    if (bFree) FreeTaskStruct(task);
+}
+
+// Event queue must be locked - grantSize is 0 unless PushGrantEvent has just made the grant, and only
+// the kernel's own events are control ones, which are never lost to a flood of anything else
+static int QueueEvent(Task* task, TaskEvent* event, uint32_t processIDSource, uint32_t grantSize, bool bControl)
+{
+    TaskEventQueue* pQueue = task->pEventQueue;
+    uint32_t tail = task->eventTail;
+    uint32_t head = SyncEventHead(task);
+
+    // Check event queue is not full - the task may be consuming without the lock - and
+    // that bulk events leave room for control ones, so they're never crowded out
+    uint32_t capacity = bControl ? MAX_TASK_EVENTS : MAX_TASK_EVENTS - CONTROL_EVENT_SLOTS;
+    if (tail - head >= capacity)
+    {
+        task->nDroppedEvents++;
+        return -1;
+    }
+
+    // Push event, only then making it visible
+    TaskEvent* pSlot = &pQueue->events[EventSlot(tail)];
+    memcpy(pSlot, event, sizeof(TaskEvent));
+    pSlot->source = processIDSource;
+    pSlot->grant = (grantSize != 0) ? event->grant : 0;
+    task->eventGrants[EventSlot(tail)] = pSlot->grant;
+    task->eventGrantSizes[EventSlot(tail)] = grantSize;
+    task->eventTail = tail + 1;
+    __atomic_store_n(&pQueue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Scheduler must be locked
+static void WakeForEvent(Task* task, uint32_t id)
+{
+    // Unblock process, unless it's waiting for another event, its next period or IPC
+    if (task->blockedEvent != 0 && id != task->blockedEvent) return;
+    if (task->ipcState != IPC_IDLE || task->futexKey != 0) return;
+    if (task->nWaitIDs != 0)
+    {
+        uint32_t i = 0;
+        while (i < task->nWaitIDs && task->waitIDs[i] != id) i++;
+        if (i == task->nWaitIDs) return;
+    }
+    if (!task->bWaitingForPeriod && !task->bWaitingForChild) WakeTask(task);
+}
+
+static int PushEvent(Task* task, TaskEvent* event, uint32_t processIDSource, uint32_t grantSize, bool bControl)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&eventLock);
+
+    if (QueueEvent(task, event, processIDSource, grantSize, bControl) != 0)
+    {
+        ReleaseSpinLock(&eventLock);
+        RestoreInterrupts(flags);
+        return -1;
+    }
+
+    ReleaseSpinLock(&eventLock);
+
+    AcquireSpinLock(&schedulerLock);
+    WakeForEvent(task, event->id);
+    ReleaseSpinLock(&schedulerLock);
+
+    RestoreInterrupts(flags);
+    return 0;
+}
+
+int PushEvent(Task* task, TaskEvent* event, uint32_t processIDSource)
+{
+    return PushEvent(task, event, processIDSource, 0, false);
+}
+
+int PushEvent(Task* task, TaskEvent* event)
+{
+    // Interrupts may push events whilst idle
+    Task* current = GetCurrentTask();
+    return PushEvent(task, event, current == nullptr ? 0 : current->processID);
+}
+
+int PushGrantEvent(Task* task, TaskEvent* event)
+{
+    if (event->length <= EVENT_INLINE_SIZE)
+    {
+        event->grant = 0;
+        return PushEvent(task, event);
+    }
+    if (event->length > EVENT_MAX_GRANT) return -1;
+
+    // Copied once, into pages the receiver owns as if it had malloc'd them
+    uint32_t size = GrantSize(event);
+    void* pGrant = kmalloc(size, USER_PAGE, false);
+    if (pGrant == nullptr) return -1;
+    memcpy(pGrant, (void*)event->grant, event->length);
+
+    // Counted before it's queued, as the receiver may free it straight away (see SysFree)
+    Task* process = (task->pProcess != nullptr) ? task->pProcess : task;
+    __atomic_fetch_add(&process->size, size, __ATOMIC_RELAXED);
+
+    TaskEvent granted;
+    memcpy(&granted, event, sizeof(TaskEvent));
+    granted.grant = (uint32_t)pGrant;
+    Task* current = GetCurrentTask();
+    if (PushEvent(task, &granted, current == nullptr ? 0 : current->processID, size, false) != 0)
+    {
+        __atomic_fetch_sub(&process->size, size, __ATOMIC_RELAXED);
+        kfree(pGrant, size);
+        return -1;
+    }
+    return 0;
+}
+
+int PopLastEvent(uint32_t event)
+{
+    Task* task = GetCurrentTask();
+    TaskEventQueue* pQueue = task->pEventQueue;
+    int result = -1;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&eventLock);
+
+    // Find first event in question, and mark it removed rather than shifting the rest down
+    uint32_t grant = 0;
+    uint32_t grantSize = 0;
+    for (uint32_t i = SyncEventHead(task); i != task->eventTail; ++i)
+    {
+        if (IsEventRemoved(pQueue, i) || pQueue->events[EventSlot(i)].id != event) continue;
+
+        grant = task->eventGrants[EventSlot(i)];
+        grantSize = task->eventGrantSizes[EventSlot(i)];
+        task->eventGrants[EventSlot(i)] = 0;
+        pQueue->removed |= 1ull << EventSlot(i);
+        result = 0;
+        break;
+    }
+
+    ReleaseSpinLock(&eventLock);
+    RestoreInterrupts(flags);
+
+    // Never seen, so never freed by the task itself
+    if (grant != 0)
+    {
+        __atomic_fetch_sub(&GetCurrentProcess()->size, grantSize, __ATOMIC_RELAXED);
+        kfree((void*)grant, grantSize);
+    }
+
+    return result;
+}
+
+void SubscribeToStdout(bool subscribe)
+{
+    Subscribe(TOPIC_STDOUT, subscribe);
+}
+
+// Task list must be locked
+static Task* FindStdoutReader(Task* process)
+{
+    // Walk up process tree until a subscriber of stdout is found, if there are any
+    if (pSubscribers[TOPIC_STDOUT] == nullptr) return (Task*)nullptr;
+    Task* task = FindTask(process->parentID);
+    while (task != nullptr && !task->bSubscribed[TOPIC_STDOUT]) task = FindTask(task->parentID);
+    return task;
+}
+
+// Task list and scheduler must be locked
+static void WakeWaitersOn(Stream* stream)
+{
+    Task* task = pTaskListTail;
+    for (size_t i = 0; i < nTasks; ++i, task = task->pNextTask)
+    {
+        if (task->pWaitingForStream == stream) WakeTask(task);
+    }
+}
+
+static void InitStream(Stream* stream)
+{
+    stream->pBuffer = (char*)kmalloc(STDOUT_BUFFER_SIZE);
+    stream->head = 0;
+    stream->tail = 0;
+    stream->bNotified = false;
+}
+
+int WriteStdout(const char* pData, uint32_t length)
+{
+    Task* task = GetCurrentTask();
+    Task* process = (task->pProcess != nullptr) ? task->pProcess : task;
+
+    // Redirected by our parent (see CreateTask)
+    if (process->pipeEnds[PIPE_STDOUT].pPipe != nullptr) return (PipeWrite(PIPE_STDOUT, pData, length) < 0) ? -1 : 0;
+
+    // Most processes never write, so only set up on the first one (which threads may race to)
+    if (__atomic_load_n(&process->pStdout, __ATOMIC_ACQUIRE) == nullptr)
+    {
+        Stream* stream = (Stream*)kmalloc(sizeof(Stream));
+        InitStream(stream);
+
+        Stream* expected = nullptr;
+        if (!__atomic_compare_exchange_n(&process->pStdout, &expected, stream, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            kfree(stream->pBuffer, STDOUT_BUFFER_SIZE);
+            kfree(stream, sizeof(Stream));
+        }
+    }
+    Stream* stream = process->pStdout;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    while (true)
+    {
+        AcquireSpinLock(&taskListLock);
+        Task* reader = FindStdoutReader(process);
+
+        // Else, just print to kernel screen
+        if (reader == nullptr)
+        {
+            ReleaseSpinLock(&taskListLock);
+            RestoreInterrupts(flags);
+
+            char buffer[64];
+            for (uint32_t i = 0; i < length; i += sizeof(buffer) - 1)
+            {
+                uint32_t nBytes = (length - i < sizeof(buffer) - 1) ? length - i : sizeof(buffer) - 1;
+                memcpy(buffer, (void*)&pData[i], nBytes);
+                buffer[nBytes] = '\0';
+                VGA_printf(buffer, false);
+            }
+            return 0;
+        }
+
+        // As much as fits
+        AcquireSpinLock(&eventLock);
+        uint32_t nBytes = STDOUT_BUFFER_SIZE - (stream->tail - stream->head);
+        if (nBytes > length) nBytes = length;
+        for (uint32_t i = 0; i < nBytes; ++i) stream->pBuffer[(stream->tail + i) & (STDOUT_BUFFER_SIZE - 1)] = pData[i];
+        stream->tail += nBytes;
+        pData += nBytes;
+        length -= nBytes;
+
+        // One event until the reader has caught up, however much more is written - if
+        // its queue is full, the next write (or recheck, if we're blocked) tries again
+        AcquireSpinLock(&schedulerLock);
+        if (!stream->bNotified && stream->head != stream->tail)
+        {
+            TaskEvent event;
+            event.id = EVENT_QUEUE_STDOUT;
+            event.length = 0;
+            event.grant = 0;
+            stream->bNotified = QueueEvent(reader, &event, process->processID, 0, true) == 0;
+            if (stream->bNotified) WakeForEvent(reader, event.id);
+        }
+        ReleaseSpinLock(&eventLock);
+        ReleaseSpinLock(&taskListLock);
+
+        if (length == 0)
+        {
+            ReleaseSpinLock(&schedulerLock);
+            RestoreInterrupts(flags);
+            return 0;
+        }
+
+        // Full, so block until the reader makes room - or goes away, which nobody tells us about
+        task->pWaitingForStream = stream;
+        task->bBlocked = true;
+        task->blockedEvent = 0;
+        AddSleepingTask(task, nTicks + STDOUT_RECHECK_TICKS);
+        SwitchTask();
+
+        RemoveSleepingTask(task);
+        task->pWaitingForStream = nullptr;
+        ReleaseSpinLock(&schedulerLock);
+    }
+}
+
+int ReadStdout(uint32_t processID, char* pBuffer, uint32_t size)
+{
+    Task* current = GetCurrentTask();
+    Task* process = (current->pProcess != nullptr) ? current->pProcess : current;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+
+    // Only its reader may, and zombies keep theirs until they're waited for
+    Task* writer = FindTask(processID);
+    Stream* stream = (writer == nullptr) ? nullptr : __atomic_load_n(&writer->pStdout, __ATOMIC_ACQUIRE);
+    if (stream == nullptr || FindStdoutReader(writer) != process)
+    {
+        ReleaseSpinLock(&taskListLock);
+        RestoreInterrupts(flags);
+        return -1;
+    }
+
+    AcquireSpinLock(&eventLock);
+    uint32_t nBytes = stream->tail - stream->head;
+    if (nBytes > size) nBytes = size;
+    for (uint32_t i = 0; i < nBytes; ++i) pBuffer[i] = stream->pBuffer[(stream->head + i) & (STDOUT_BUFFER_SIZE - 1)];
+    stream->head += nBytes;
+
+    // Caught up, so the next write sends another event
+    if (stream->head == stream->tail) stream->bNotified = false;
+
+    AcquireSpinLock(&schedulerLock);
+    if (nBytes > 0) WakeWaitersOn(stream);
+    ReleaseSpinLock(&schedulerLock);
+    ReleaseSpinLock(&eventLock);
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    return (int)nBytes;
+}
+
+// Event queue must be locked
+static Pipe* GetPipe(Task* process, uint32_t end, bool bWrite)
+{
+    if (end >= MAX_PIPE_ENDS) return (Pipe*)nullptr;
+    PipeEnd* pEnd = &process->pipeEnds[end];
+    return (pEnd->pPipe != nullptr && pEnd->bWrite == bWrite) ? pEnd->pPipe : (Pipe*)nullptr;
+}
+
+// Event queue must be locked
+static void HoldPipeEnd(PipeEnd* pEnd, Pipe* pipe, bool bWrite)
+{
+    pEnd->pPipe = pipe;
+    pEnd->bWrite = bWrite;
+    if (bWrite) pipe->nWriters++;
+    else pipe->nReaders++;
+}
+
+// Task list, event queue and scheduler must be locked - returns the pipe if it's to be freed
+static Pipe* DropPipeEnd(PipeEnd* pEnd)
+{
+    Pipe* pipe = pEnd->pPipe;
+    pEnd->pPipe = nullptr;
+    if (pEnd->bWrite) pipe->nWriters--;
+    else pipe->nReaders--;
+
+    // The other side sees EOF or a broken pipe
+    WakeWaitersOn(&pipe->stream);
+    return (pipe->nReaders == 0 && pipe->nWriters == 0) ? pipe : (Pipe*)nullptr;
+}
+
+static void FreePipe(Pipe* pipe)
+{
+    kfree(pipe->stream.pBuffer, STDOUT_BUFFER_SIZE);
+    kfree(pipe, sizeof(Pipe));
+}
+
+static void ClosePipeEnds(Task* process)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&eventLock);
+    AcquireSpinLock(&schedulerLock);
+
+    Pipe* pFreed[MAX_PIPE_ENDS];
+    uint32_t nFreed = 0;
+    for (uint32_t i = 0; i < MAX_PIPE_ENDS; ++i)
+    {
+        if (process->pipeEnds[i].pPipe == nullptr) continue;
+        Pipe* pipe = DropPipeEnd(&process->pipeEnds[i]);
+        if (pipe != nullptr) pFreed[nFreed++] = pipe;
+    }
+
+    ReleaseSpinLock(&schedulerLock);
+    ReleaseSpinLock(&eventLock);
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    for (uint32_t i = 0; i < nFreed; ++i) FreePipe(pFreed[i]);
+}
+
+// Event queue must be locked
+static void InheritPipeEnd(Task* task, uint32_t slot, Task* parent, uint32_t end, bool bWrite)
+{
+    Pipe* pipe = (parent == nullptr || end == PIPE_NONE) ? (Pipe*)nullptr : GetPipe(parent, end, bWrite);
+    if (pipe != nullptr) HoldPipeEnd(&task->pipeEnds[slot], pipe, bWrite);
+}
+
+int CreatePipe(uint32_t* pEnds)
+{
+    Task* process = GetCurrentProcess();
+
+    Pipe* pipe = (Pipe*)kmalloc(sizeof(Pipe));
+    InitStream(&pipe->stream);
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&eventLock);
+
+    // Never given out as stdin or stdout, which only our parent can set
+    uint32_t readEnd = PIPE_STDOUT + 1;
+    while (readEnd < MAX_PIPE_ENDS && process->pipeEnds[readEnd].pPipe != nullptr) readEnd++;
+    uint32_t writeEnd = readEnd + 1;
+    while (writeEnd < MAX_PIPE_ENDS && process->pipeEnds[writeEnd].pPipe != nullptr) writeEnd++;
+
+    if (writeEnd >= MAX_PIPE_ENDS)
+    {
+        ReleaseSpinLock(&eventLock);
+        RestoreInterrupts(flags);
+        FreePipe(pipe);
+        return -1;
+    }
+
+    HoldPipeEnd(&process->pipeEnds[readEnd], pipe, false);
+    HoldPipeEnd(&process->pipeEnds[writeEnd], pipe, true);
+
+    ReleaseSpinLock(&eventLock);
+    RestoreInterrupts(flags);
+
+    pEnds[0] = readEnd;
+    pEnds[1] = writeEnd;
+    return 0;
+}
+
+int ClosePipeEnd(uint32_t end)
+{
+    Task* process = GetCurrentProcess();
+    if (end >= MAX_PIPE_ENDS) return -1;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&eventLock);
+    AcquireSpinLock(&schedulerLock);
+
+    bool bOpen = process->pipeEnds[end].pPipe != nullptr;
+    Pipe* pFreed = bOpen ? DropPipeEnd(&process->pipeEnds[end]) : (Pipe*)nullptr;
+
+    ReleaseSpinLock(&schedulerLock);
+    ReleaseSpinLock(&eventLock);
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    if (pFreed != nullptr) FreePipe(pFreed);
+    return bOpen ? 0 : -1;
+}
+
+bool IsPipeEnd(uint32_t end, bool bWrite)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&eventLock);
+    bool bIsEnd = GetPipe(GetCurrentProcess(), end, bWrite) != nullptr;
+    ReleaseSpinLock(&eventLock);
+    RestoreInterrupts(flags);
+
+    return bIsEnd;
+}
+
+// Task list and event queue must be locked, and are released with only the scheduler left locked
+static void BlockOnPipe(Task* task, Pipe* pipe)
+{
+    AcquireSpinLock(&schedulerLock);
+    ReleaseSpinLock(&eventLock);
+    ReleaseSpinLock(&taskListLock);
+
+    task->pWaitingForStream = &pipe->stream;
+    task->bBlocked = true;
+    task->blockedEvent = 0;
+    SwitchTask();
+    task->pWaitingForStream = nullptr;
+}
+
+int PipeRead(uint32_t end, char* pBuffer, uint32_t size)
+{
+    Task* task = GetCurrentTask();
+    Task* process = GetCurrentProcess();
+    uint32_t flags = SaveAndDisableInterrupts();
+
+    while (true)
+    {
+        AcquireSpinLock(&taskListLock);
+        AcquireSpinLock(&eventLock);
+
+        Pipe* pipe = GetPipe(process, end, false);
+        if (pipe == nullptr)
+        {
+            ReleaseSpinLock(&eventLock);
+            ReleaseSpinLock(&taskListLock);
+            RestoreInterrupts(flags);
+            return -1;
+        }
+
+        Stream* stream = &pipe->stream;
+        uint32_t available = stream->tail - stream->head;
+        uint32_t nBytes = (available < size) ? available : size;
+        for (uint32_t i = 0; i < nBytes; ++i) pBuffer[i] = stream->pBuffer[(stream->head + i) & (STDOUT_BUFFER_SIZE - 1)];
+        stream->head += nBytes;
+
+        // Nothing left, and nothing more coming
+        if (nBytes > 0 || pipe->nWriters == 0 || size == 0)
+        {
+            AcquireSpinLock(&schedulerLock);
+            if (nBytes > 0) WakeWaitersOn(stream);
+            ReleaseSpinLock(&schedulerLock);
+            ReleaseSpinLock(&eventLock);
+            ReleaseSpinLock(&taskListLock);
+            RestoreInterrupts(flags);
+            return (int)nBytes;
+        }
+
+        BlockOnPipe(task, pipe);
+        ReleaseSpinLock(&schedulerLock);
+    }
+}
+
+int PipeWrite(uint32_t end, const char* pData, uint32_t length)
+{
+    Task* task = GetCurrentTask();
+    Task* process = GetCurrentProcess();
+    uint32_t nWritten = 0;
+    uint32_t flags = SaveAndDisableInterrupts();
+
+    while (true)
+    {
+        AcquireSpinLock(&taskListLock);
+        AcquireSpinLock(&eventLock);
+
+        // Broken pipe, or closed by another thread
+        Pipe* pipe = GetPipe(process, end, true);
+        if (pipe == nullptr || pipe->nReaders == 0)
+        {
+            ReleaseSpinLock(&eventLock);
+            ReleaseSpinLock(&taskListLock);
+            RestoreInterrupts(flags);
+            return (nWritten > 0) ? (int)nWritten : -1;
+        }
+
+        // As much as fits
+        Stream* stream = &pipe->stream;
+        uint32_t nBytes = STDOUT_BUFFER_SIZE - (stream->tail - stream->head);
+        if (nBytes > length - nWritten) nBytes = length - nWritten;
+        for (uint32_t i = 0; i < nBytes; ++i) stream->pBuffer[(stream->tail + i) & (STDOUT_BUFFER_SIZE - 1)] = pData[nWritten + i];
+        stream->tail += nBytes;
+        nWritten += nBytes;
+
+        if (nBytes > 0)
+        {
+            AcquireSpinLock(&schedulerLock);
+            WakeWaitersOn(stream);
+            ReleaseSpinLock(&schedulerLock);
+        }
+
+        if (nWritten == length)
+        {
+            ReleaseSpinLock(&eventLock);
+            ReleaseSpinLock(&taskListLock);
+            RestoreInterrupts(flags);
+            return (int)nWritten;
+        }
+
+        // Full, so wait for a reader to make room
+        BlockOnPipe(task, pipe);
+        ReleaseSpinLock(&schedulerLock);
+    }
+}
+
+// Handles carry the slot's generation, and are never 0 (see SharedRegion)
+static inline uint32_t SharedRegionHandle(uint32_t slot)
+{
+    return ((sharedRegions[slot].generation & 0xFFFF) << 8) | (slot + 1);
+}
+
+// Shared regions must be locked
+static SharedRegion* GetSharedRegion(uint32_t handle)
+{
+    uint32_t slot = (handle & 0xFF) - 1;
+    if (slot >= MAX_SHARED_REGIONS || sharedRegions[slot].address == 0) return (SharedRegion*)nullptr;
+    if (SharedRegionHandle(slot) != handle) return (SharedRegion*)nullptr;
+    return &sharedRegions[slot];
+}
+
+// Shared regions must be locked - returns the region if that was its last reference, for the caller to free
+static SharedRegion* DropSharedMapping(Task* process, uint32_t mapping, SharedRegion* pFreed)
+{
+    SharedRegion* region = GetSharedRegion(process->sharedMappings[mapping]);
+    process->sharedMappings[mapping] = 0;
+    if (region == nullptr || --region->nReferences > 0) return (SharedRegion*)nullptr;
+
+    // Copied out, as the slot may be reused as soon as it's unlocked
+    *pFreed = *region;
+    region->address = 0;
+    region->generation++;
+    return pFreed;
+}
+
+int CreateSharedRegion(uint32_t size)
+{
+    if (size == 0) return -1;
+    size = (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+    // Identity-mapped user pages like malloc's, so it's at the same address in everyone's
+    uint32_t address = (uint32_t)kmalloc(size, USER_PAGE, false);
+    if (address == 0) return -1;
+
+    Task* process = GetCurrentProcess();
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&sharedRegionLock);
+
+    uint32_t slot = 0;
+    while (slot < MAX_SHARED_REGIONS && sharedRegions[slot].address != 0) slot++;
+    uint32_t mapping = 0;
+    while (mapping < MAX_SHARED_MAPPINGS && process->sharedMappings[mapping] != 0) mapping++;
+
+    if (slot == MAX_SHARED_REGIONS || mapping == MAX_SHARED_MAPPINGS)
+    {
+        ReleaseSpinLock(&sharedRegionLock);
+        RestoreInterrupts(flags);
+        kfree((void*)address, size);
+        return -1;
+    }
+
+    // Mapped by its creator, so it lives until they unmap it or exit
+    sharedRegions[slot].address = address;
+    sharedRegions[slot].size = size;
+    sharedRegions[slot].nReferences = 1;
+    uint32_t handle = SharedRegionHandle(slot);
+    process->sharedMappings[mapping] = handle;
+
+    ReleaseSpinLock(&sharedRegionLock);
+    RestoreInterrupts(flags);
+    return (int)handle;
+}
+
+uint32_t MapSharedRegion(uint32_t handle)
+{
+    Task* process = GetCurrentProcess();
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&sharedRegionLock);
+
+    SharedRegion* region = GetSharedRegion(handle);
+    uint32_t address = 0;
+    if (region != nullptr)
+    {
+        // Mapping it twice only takes the one reference
+        uint32_t mapping = MAX_SHARED_MAPPINGS;
+        for (uint32_t i = 0; i < MAX_SHARED_MAPPINGS; ++i)
+        {
+            if (process->sharedMappings[i] == handle) { mapping = i; break; }
+            if (process->sharedMappings[i] == 0 && mapping == MAX_SHARED_MAPPINGS) mapping = i;
+        }
+
+        if (mapping < MAX_SHARED_MAPPINGS)
+        {
+            if (process->sharedMappings[mapping] != handle) region->nReferences++;
+            process->sharedMappings[mapping] = handle;
+            address = region->address;
+        }
+    }
+
+    ReleaseSpinLock(&sharedRegionLock);
+    RestoreInterrupts(flags);
+    return address;
+}
+
+int UnmapSharedRegion(uint32_t handle)
+{
+    Task* process = GetCurrentProcess();
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&sharedRegionLock);
+
+    uint32_t mapping = 0;
+    while (mapping < MAX_SHARED_MAPPINGS && (handle == 0 || process->sharedMappings[mapping] != handle)) mapping++;
+
+    SharedRegion freed;
+    SharedRegion* pFreed = nullptr;
+    if (mapping < MAX_SHARED_MAPPINGS) pFreed = DropSharedMapping(process, mapping, &freed);
+
+    ReleaseSpinLock(&sharedRegionLock);
+    RestoreInterrupts(flags);
+
+    if (pFreed != nullptr) kfree((void*)pFreed->address, pFreed->size);
+    return (mapping < MAX_SHARED_MAPPINGS) ? 0 : -1;
+}
+
+static void UnmapSharedRegions(Task* process)
+{
+    for (uint32_t i = 0; i < MAX_SHARED_MAPPINGS; ++i)
+    {
+        uint32_t flags = SaveAndDisableInterrupts();
+        AcquireSpinLock(&sharedRegionLock);
+
+        SharedRegion freed;
+        SharedRegion* pFreed = nullptr;
+        if (process->sharedMappings[i] != 0) pFreed = DropSharedMapping(process, i, &freed);
+
+        ReleaseSpinLock(&sharedRegionLock);
+        RestoreInterrupts(flags);
+
+        if (pFreed != nullptr) kfree((void*)pFreed->address, pFreed->size);
+    }
+}
+
+void OnStdout(const char* message)
+{
+    WriteStdout(message, strlen(message));
+}
+
+void OnStdout(uint32_t data, bool hex)
+{
+    // Formatted here, then written in one go
+    const uint32_t base = hex ? 16 : 10;
+    char digits[10];
+    uint32_t nDigits = 0;
+    do
+    {
+        uint32_t digit = data % base;
+        digits[nDigits++] = (char)(digit < 10 ? '0' + digit : 'A' + digit - 10);
+    } while (data /= base);
+
+    char buffer[2 + sizeof(digits)];
+    uint32_t length = 0;
+    if (hex) { buffer[length++] = '0'; buffer[length++] = 'x'; }
+    while (nDigits > 0) buffer[length++] = digits[--nDigits];
+
+    WriteStdout(buffer, length);
+}
+
+void SubscribeToSysexit(bool subscribe)
+{
+    Subscribe(TOPIC_SYSEXIT, subscribe);
+}
+
+void OnSysexit(uint32_t exitingProcessID, uint32_t exitCode)
+{
+    TaskEvent event;     
+    event.id = EVENT_QUEUE_SYSEXIT;
+    event.length = sizeof(exitCode);
+    event.grant = 0;
+    memcpy(event.data, &exitCode, sizeof(exitCode));
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+
+    // Walk up process tree, dispatching to every subscriber of sysexit, if there are any
+    Task* exiting = FindTask(exitingProcessID);
+    Task* task = (exiting == nullptr || pSubscribers[TOPIC_SYSEXIT] == nullptr) ? (Task*)nullptr : FindTask(exiting->parentID);
+    while (task != nullptr)
+    {
+        if (task->bSubscribed[TOPIC_SYSEXIT]) PushEvent(task, &event, exitingProcessID, 0, true);
+        task = FindTask(task->parentID);
+    }
+
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+}
+
+void OnSysexit(uint32_t exitCode)
+{
+    OnSysexit(GetCurrentTask()->pProcess->processID, exitCode);
+}
+
+void SubscribeToKeyboard(bool subscribe)
+{
+    Subscribe(TOPIC_KEYBOARD, subscribe);
+}
+
+int FocusKeyboard(uint32_t processID)
+{
+    Task* process = GetCurrentProcess();
+    int result = -1;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+
+    // Only whoever has focus may hand it on, to any of the process's subscribed threads
+    if (pKeyboardFocus == nullptr || pKeyboardFocus->pProcess == process)
+    {
+        for (Task* task = pSubscribers[TOPIC_KEYBOARD]; task != nullptr; task = task->pNextSubscriber[TOPIC_KEYBOARD])
+        {
+            if (task->pProcess->processID != processID) continue;
+            pKeyboardFocus = task;
+            result = 0;
+            break;
+        }
+    }
+
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+    return result;
+}
+
+void OnKeyEvent(char key, bool bSpecial)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+
+    // Background tasks never see it
+    if (pKeyboardFocus != nullptr)
+    {
+        TaskEvent event;
+        event.id = EVENT_QUEUE_KEY_PRESS;
+        event.length = 2;
+        event.grant = 0;
+        event.data[0] = key;
+        event.data[1] = bSpecial;
+        Task* current = GetCurrentTask();
+        PushEvent(pKeyboardFocus, &event, current == nullptr ? 0 : current->processID, 0, true);
+    }
+
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+}
+
+void KillTask(Task* task)
+{
+    // Threads share memory, so the whole process has to go
+    if (task->type == USER_TASK) { ExitProcess(task, (uint32_t)EXIT_CODE_KILLED); return; }
+
+    // A task preempted mid-syscall may hold kernel locks, so
+    // let it finish and exit on its way back to ring 3 instead
+    if (task->bPreemptible) { task->bKillPending = true; return; }
+
+    TaskExit(task);
+}
+
+void OnProcessBlock(uint32_t event)
+{
+    Task* task = GetCurrentTask();
+    task->blockedEvent = event;
+    task->bBlocked = true;
+
+    // Sleep right here in the kernel until PushEvent wakes us
+    Schedule();
+}
+
+void BeginPreemptibleSection()
+{
+    GetCurrentTask()->bPreemptible = true;
+    EnableInterrupts();
+}
+
+void EndPreemptibleSection()
+{
+    DisableInterrupts();
+    Task* task = GetCurrentTask();
+    task->bPreemptible = false;
+
+    // Killed whilst we were busy
+    if (task->bKillPending) TaskExit();
+}
+
+void AcquireLock(KernelLock* lock)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+
+    // Whoever holds it was preempted, so let them finish
+    while (__atomic_exchange_n(&lock->bLocked, true, __ATOMIC_ACQUIRE)) Schedule();
+
+    RestoreInterrupts(flags);
+}
+
+void ReleaseLock(KernelLock* lock)
+{
+    __atomic_store_n(&lock->bLocked, false, __ATOMIC_RELEASE);
+}
+
+void OnDeviceNotAvailable()
+{
+    ClearTaskSwitched();
+
+    // Owners are cleared by other CPUs as tasks exit
+    AcquireSpinLock(&schedulerLock);
+    CPU* cpu = GetCPU();
+
+    // Idle and kernel tasks have no FPU state of their own
+    Task* task = (cpu->pCurrentTask != nullptr && cpu->pCurrentTask->type == USER_TASK) ? cpu->pCurrentTask : nullptr;
+    if (cpu->pFPUOwner != task)
+    {
+        // Save previous owner's state and bring in the current task's
+        if (cpu->pFPUOwner != nullptr) SaveFPUState(cpu->pFPUOwner->pFPUState);
+        if (task != nullptr) RestoreFPUState(task->pFPUState);
+        cpu->pFPUOwner = task;
+    }
+
+    ReleaseSpinLock(&schedulerLock);
 }
 
 uint32_t GetProcess(const char* sName)
 {
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+
+    Task* task = pProcessesByName[HashName(sName)];
+    while (task != nullptr && !strcmp(task->sName, sName)) task = task->pNextWithName;
+    uint32_t processID = (task == nullptr) ? (uint32_t)-1 : task->processID;
+
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    return processID;
+}
+
+uint32_t GetTaskStats(TaskStats* pStats, uint32_t maxTasks)
+{
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&schedulerLock);
+
+    // Charge whatever's running or blocked right now, as of one moment for every task
+    uint64_t now = ReadTimestampCounter();
     Task* task = pTaskListTail;
-    unsigned int count = 0;
-    while (count < nTasks)
+    uint32_t count = 0;
+    for (; count < nTasks && count < maxTasks; ++count, task = task->pNextTask)
+    {
+        TaskStats* stats = &pStats[count];
+        stats->processID = task->processID;
+        stats->mainThreadID = (task->pProcess == nullptr) ? task->processID : task->pProcess->processID;
+        stats->parentID = task->parentID;
+        strncpy(stats->sName, task->sName, sizeof(stats->sName));
+        stats->cpu = (task->pCPU == nullptr) ? 0 : task->pCPU->id;
+
+        if (task->bZombie) stats->state = TASK_STATE_ZOMBIE;
+        else if (task->bRunning) stats->state = TASK_STATE_RUNNING;
+        else if (task->bBlocked) stats->state = TASK_STATE_BLOCKED;
+        else stats->state = TASK_STATE_READY;
+
+        stats->runCycles = task->runCycles;
+        if (task->bRunning) stats->runCycles += now - task->switchedInAt;
+        stats->blockedCycles = task->blockedCycles;
+        if (task->blockedSince != 0) stats->blockedCycles += now - task->blockedSince;
+
+        stats->nSwitches = task->nSwitches;
+        stats->nSyscalls = task->nSyscalls;
+        stats->nPageFaults = task->nPageFaults;
+        stats->nDeadlineMisses = task->nDeadlineMisses;
+        stats->nDroppedEvents = task->nDroppedEvents;
+    }
+
+    ReleaseSpinLock(&schedulerLock);
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    return count;
+}
+
+int SetChildCPUQuota(uint32_t quota, uint32_t period)
+{
+    // A quota of 0 lifts the limit
+    if (quota != 0 && period == 0) return -1;
+
+    // Only applies to children created from now on
+    Task* process = GetCurrentTask()->pProcess;
+    TaskGroup* group = process->pChildGroup;
+    if (group == nullptr)
+    {
+        group = (TaskGroup*) kmalloc(sizeof(TaskGroup));
+        group->pParent = HoldGroup(process->pGroup);
+        group->nReferences = 1;
+    }
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    // Another thread may have beaten us to it
+    if (process->pChildGroup == nullptr) process->pChildGroup = group;
+    else if (process->pChildGroup != group)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+        ReleaseGroup(group);
+        return SetChildCPUQuota(quota, period);
+    }
+
+    group->quota = quota;
+    group->period = period;
+    group->used = 0;
+    group->periodEnd = nTicks + period;
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+    return 0;
+}
+
+int SetDeadline(uint32_t runtime, uint32_t period, uint32_t deadline)
+{
+    // A runtime of 0 goes back to round robin
+    if (deadline == 0) deadline = period;
+    if (runtime != 0 && (period == 0 || runtime > deadline || deadline > period)) return -1;
+    uint32_t utilisation = (runtime == 0) ? 0 : GetUtilisation(runtime, period);
+
+    Task* current = GetCurrentTask();
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    // Admission control - only reserve what every deadline can still be met within
+    uint32_t oldUtilisation = current->bDeadline ? GetUtilisation(current->runtime, current->period) : 0;
+    if (deadlineUtilisation - oldUtilisation + utilisation > nCPUs * 1024 * MAX_DEADLINE_UTILISATION / 100)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+        return -1;
+    }
+
+    LeaveDeadlineClass(current);
+    if (runtime != 0)
+    {
+        // First job starts now
+        current->runtime = runtime;
+        current->period = period;
+        current->relativeDeadline = deadline;
+        current->remainingRuntime = runtime;
+        current->absoluteDeadline = nTicks + deadline;
+        current->nextRelease = nTicks + period;
+        current->bJobDone = false;
+        current->bDeadline = true;
+        current->pNextDeadline = pDeadlineTasks;
+        pDeadlineTasks = current;
+        deadlineUtilisation += utilisation;
+    }
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+    return 0;
+}
+
+int YieldPeriod()
+{
+    Task* current = GetCurrentTask();
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    if (!current->bDeadline)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+        return -1;
+    }
+
+    // This job's done, if late, so sleep until the next is released
+    if ((int32_t)(nTicks - current->absoluteDeadline) > 0) current->nDeadlineMisses++;
+    current->bJobDone = true;
+    current->bWaitingForPeriod = true;
+    current->bBlocked = true;
+    current->blockedEvent = 0;
+    SwitchTask();
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+    return 0;
+}
+
+int WaitForChild(uint32_t processID, int* pStatus)
+{
+    Task* current = GetCurrentTask();
+    uint32_t parentID = current->pProcess->processID;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&schedulerLock);
+
+    Task* pZombie = nullptr;
+    while (true)
+    {
+        // Only our own children, which the reaper has finished with
+        bool bFound = false;
+        Task* task = (processID == WAIT_ANY_CHILD) ? pTaskListTail : FindTask(processID);
+        size_t nCandidates = (processID == WAIT_ANY_CHILD) ? nTasks : (task != nullptr);
+        for (size_t i = 0; i < nCandidates && pZombie == nullptr; ++i, task = task->pNextTask)
+        {
+            if (!task->bMainThread || task->parentID != parentID) continue;
+            bFound = true;
+            if (task->bZombie && task->bReleased) pZombie = task;
+        }
+        if (pZombie != nullptr || !bFound) break;
+
+        // Sleep until the reaper's done with one of them
+        current->bWaitingForChild = true;
+        current->bBlocked = true;
+        current->blockedEvent = 0;
+        ReleaseSpinLock(&taskListLock);
+        SwitchTask();
+        ReleaseSpinLock(&schedulerLock);
+
+        AcquireSpinLock(&taskListLock);
+        AcquireSpinLock(&schedulerLock);
+    }
+
+    if (pZombie != nullptr) UnlinkTask(pZombie);
+
+    ReleaseSpinLock(&schedulerLock);
+    ReleaseSpinLock(&taskListLock);
+    RestoreInterrupts(flags);
+
+    if (pZombie == nullptr) return -1;
+
+    uint32_t childID = pZombie->processID;
+    if (pStatus != nullptr) *pStatus = (int)pZombie->exitCode;
+    DropTaskStruct(pZombie);
+    return (int)childID;
+}
+
+// Task list and scheduler must be locked
+static void FailIPC(Task* task)
+{
+    task->ipcState = IPC_IDLE;
+    task->ipcResult = -1;
+    WakeTask(task);
+}
+
+// Task list and scheduler must be locked
+static void AbortIPC(Task* task)
+{
+    // Anyone sending to it, or waiting for its reply, finds out it's gone
+    for (Task* sender = task->pIPCSenders; sender != nullptr; sender = sender->pNextIPCSender) FailIPC(sender);
+    task->pIPCSenders = nullptr;
+
+    Task* caller = pTaskListTail;
+    for (size_t i = 0; i < nTasks; ++i, caller = caller->pNextTask)
+    {
+        if (caller->ipcState == IPC_AWAITING_REPLY && caller->ipcPartner == task->processID) FailIPC(caller);
+    }
+
+    // ...and it stops waiting to send
+    Task* receiver = (task->ipcState == IPC_SENDING) ? FindTask(task->ipcPartner) : nullptr;
+    if (receiver != nullptr)
+    {
+        Task** ppSender = &receiver->pIPCSenders;
+        while (*ppSender != nullptr && *ppSender != task) ppSender = &(*ppSender)->pNextIPCSender;
+        if (*ppSender == task) *ppSender = task->pNextIPCSender;
+    }
+    task->ipcState = IPC_IDLE;
+}
+
+// Task list and scheduler must be locked - returns the sender, or 0 if there isn't one yet
+static uint32_t TakeIPCSender(Task* task)
+{
+    Task* sender = task->pIPCSenders;
+    if (sender == nullptr)
+    {
+        task->ipcState = IPC_RECEIVING;
+        return 0;
+    }
+    task->pIPCSenders = sender->pNextIPCSender;
+
+    memcpy(&task->ipcMessage, &sender->ipcMessage, sizeof(IPCMessage));
+    task->ipcPartner = sender->processID;
+
+    // A caller stays blocked until we reply
+    if (sender->bIPCCall) sender->ipcState = IPC_AWAITING_REPLY;
+    else
+    {
+        sender->ipcState = IPC_IDLE;
+        sender->ipcResult = 0;
+        WakeTask(sender);
+    }
+    return sender->processID;
+}
+
+// Scheduler must be locked
+static int BlockForIPC(Task* task, Task* pHandoff)
+{
+    // Only a partner (or its exit) changes our state, so anything else waking us is ignored
+    while (task->ipcState != IPC_IDLE)
+    {
+        task->bBlocked = true;
+        task->blockedEvent = 0;
+        SwitchTask(pHandoff);
+        pHandoff = nullptr;
+    }
+    return task->ipcResult;
+}
+
+static int SendIPC(uint32_t processID, IPCMessage* pMessage, bool bCall)
+{
+    Task* task = GetCurrentTask();
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&schedulerLock);
+
+    Task* receiver = FindTask(processID);
+    if (receiver == nullptr || receiver == task || receiver->bExited)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        ReleaseSpinLock(&taskListLock);
+        RestoreInterrupts(flags);
+        return -1;
+    }
+
+    // Delivered straight into a waiting receiver, which then runs in our place...
+    Task* pHandoff = nullptr;
+    task->ipcResult = 0;
+    if (receiver->ipcState == IPC_RECEIVING)
+    {
+        memcpy(&receiver->ipcMessage, pMessage, sizeof(IPCMessage));
+        receiver->ipcPartner = task->processID;
+        receiver->ipcState = IPC_IDLE;
+        WakeTask(receiver);
+        pHandoff = receiver;
+
+        if (bCall)
+        {
+            task->ipcState = IPC_AWAITING_REPLY;
+            task->ipcPartner = processID;
+        }
+    }
+
+    // ...else queued until it receives
+    else
+    {
+        memcpy(&task->ipcMessage, pMessage, sizeof(IPCMessage));
+        task->bIPCCall = bCall;
+        task->ipcState = IPC_SENDING;
+        task->ipcPartner = processID;
+        task->pNextIPCSender = nullptr;
+
+        Task** ppSender = &receiver->pIPCSenders;
+        while (*ppSender != nullptr) ppSender = &(*ppSender)->pNextIPCSender;
+        *ppSender = task;
+    }
+    ReleaseSpinLock(&taskListLock);
+
+    // Even a send that's done gives the receiver the rest of our time slice
+    if (task->ipcState == IPC_IDLE && pHandoff != nullptr) SwitchTask(pHandoff);
+    int result = BlockForIPC(task, pHandoff);
+    if (bCall && result == 0) memcpy(pMessage, &task->ipcMessage, sizeof(IPCMessage));
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+
+    return result;
+}
+
+static int ReplyIPC(uint32_t processID, IPCMessage* pMessage, bool bReceive)
+{
+    Task* task = GetCurrentTask();
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&schedulerLock);
+
+    // Only to a caller waiting on us in particular
+    Task* caller = FindTask(processID);
+    bool bReplied = caller != nullptr && caller->ipcState == IPC_AWAITING_REPLY && caller->ipcPartner == task->processID;
+    if (bReplied)
+    {
+        memcpy(&caller->ipcMessage, pMessage, sizeof(IPCMessage));
+        caller->ipcState = IPC_IDLE;
+        caller->ipcResult = 0;
+        WakeTask(caller);
+    }
+
+    if (!bReceive)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        ReleaseSpinLock(&taskListLock);
+        RestoreInterrupts(flags);
+        return bReplied ? 0 : -1;
+    }
+
+    // Then wait for the next message - running the caller in the meantime, if nothing's queued
+    uint32_t sender = TakeIPCSender(task);
+    ReleaseSpinLock(&taskListLock);
+    if (sender == 0)
+    {
+        BlockForIPC(task, bReplied ? caller : nullptr);
+        sender = task->ipcPartner;
+    }
+    memcpy(pMessage, &task->ipcMessage, sizeof(IPCMessage));
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+
+    return (int)sender;
+}
+
+int IPCSend(uint32_t processID, const IPCMessage* pMessage)
+{
+    IPCMessage message;
+    memcpy(&message, (void*)pMessage, sizeof(IPCMessage));
+    return SendIPC(processID, &message, false);
+}
+
+int IPCCall(uint32_t processID, IPCMessage* pMessage)
+{
+    return SendIPC(processID, pMessage, true);
+}
+
+int IPCReceive(IPCMessage* pMessage)
+{
+    Task* task = GetCurrentTask();
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&taskListLock);
+    AcquireSpinLock(&schedulerLock);
+
+    uint32_t sender = TakeIPCSender(task);
+    ReleaseSpinLock(&taskListLock);
+    if (sender == 0)
+    {
+        BlockForIPC(task, nullptr);
+        sender = task->ipcPartner;
+    }
+    memcpy(pMessage, &task->ipcMessage, sizeof(IPCMessage));
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+
+    return (int)sender;
+}
+
+int IPCReply(uint32_t processID, const IPCMessage* pMessage)
+{
+    IPCMessage message;
+    memcpy(&message, (void*)pMessage, sizeof(IPCMessage));
+    return ReplyIPC(processID, &message, false);
+}
+
+int IPCReplyReceive(uint32_t processID, IPCMessage* pMessage)
+{
+    return ReplyIPC(processID, pMessage, true);
+}
+
+static uint32_t GetFutexKey(Task* task, uint32_t address)
+{
+    // The user window is the process's own memory, and everything else is identity mapped
+    Task* process = (task->pProcess != nullptr) ? task->pProcess : task;
+    if (address >= USER_WINDOW_ADDRESS && address - USER_WINDOW_ADDRESS < USER_WINDOW_DIRECTORIES * DIRECTORY_SIZE)
+        return process->location + (address - USER_WINDOW_ADDRESS);
+    return address;
+}
+
+static inline uint32_t GetFutexBucket(uint32_t key) { return (key >> 2) % FUTEX_BUCKETS; }
+
+// Scheduler must be locked
+static void RemoveFutexWaiter(Task* task)
+{
+    if (task->futexKey == 0) return;
+
+    Task** ppWaiter = &pFutexWaiters[GetFutexBucket(task->futexKey)];
+    while (*ppWaiter != nullptr && *ppWaiter != task) ppWaiter = &(*ppWaiter)->pNextFutexWaiter;
+    if (*ppWaiter == task) *ppWaiter = task->pNextFutexWaiter;
+    task->futexKey = 0;
+}
+
+int FutexWait(uint32_t* pAddress, uint32_t expected, uint32_t timeout)
+{
+    Task* task = GetCurrentTask();
+    uint32_t key = GetFutexKey(task, (uint32_t)pAddress);
+    uint32_t wakeTick = nTicks + timeout;
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    // Checked under the lock FutexWake takes, so a wake can't slip in before we're queued
+    if (__atomic_load_n(pAddress, __ATOMIC_ACQUIRE) != expected || timeout == 0)
+    {
+        ReleaseSpinLock(&schedulerLock);
+        RestoreInterrupts(flags);
+        return (timeout == 0) ? FUTEX_TIMED_OUT : FUTEX_CHANGED;
+    }
+
+    // To the back of the queue, so waiters are woken in order
+    task->futexKey = key;
+    task->pNextFutexWaiter = nullptr;
+    Task** ppWaiter = &pFutexWaiters[GetFutexBucket(key)];
+    while (*ppWaiter != nullptr) ppWaiter = &(*ppWaiter)->pNextFutexWaiter;
+    *ppWaiter = task;
+
+    task->bBlocked = true;
+    task->blockedEvent = 0;
+    if (timeout != WAIT_FOREVER) AddSleepingTask(task, wakeTick);
+    SwitchTask();
+
+    // FutexWake takes us off the queue, so if we're still on it, it was the timeout
+    RemoveSleepingTask(task);
+    int result = (task->futexKey == 0) ? FUTEX_WOKEN : FUTEX_TIMED_OUT;
+    RemoveFutexWaiter(task);
+
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+
+    return result;
+}
+
+int FutexWake(uint32_t* pAddress, uint32_t nWaiters)
+{
+    uint32_t key = GetFutexKey(GetCurrentTask(), (uint32_t)pAddress);
+
+    uint32_t flags = SaveAndDisableInterrupts();
+    AcquireSpinLock(&schedulerLock);
+
+    // Oldest first
+    uint32_t nWoken = 0;
+    Task** ppWaiter = &pFutexWaiters[GetFutexBucket(key)];
+    while (*ppWaiter != nullptr && nWoken < nWaiters)
     {
-        if (strcmp(task->sName, sName)) return task->processID;
-        task = task->pNextTask;
-        count++;
+        Task* waiter = *ppWaiter;
+        if (waiter->futexKey != key) { ppWaiter = &waiter->pNextFutexWaiter; continue; }
+
+        *ppWaiter = waiter->pNextFutexWaiter;
+        waiter->futexKey = 0;
+        WakeTask(waiter);
+        nWoken++;
     }
 
-    return -1;
+    ReleaseSpinLock(&schedulerLock);
+    RestoreInterrupts(flags);
+
+    return (int)nWoken;
 }
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include "smp.h"
+#include "multitask.h"
+#include "fpu.h"
+#include "../memory/gdt.h"
+#include "../memory/paging.h"
+#include "../interrupts/interrupts.h"
+#include "../io/apic.h"
+#include "../io/acpi.h"
+#include "../gfx/vga.h"
+#include "stdlib.h"
+
+static_assert(offsetof(CPU, pSelf) == 0 && offsetof(CPU, pCurrentTask) == 4, "GetCPU and GetCurrentTask read these through fs");
+
+CPU cpus[MAX_CPUS];
+uint32_t nCPUs = 1;
+
+// One shootdown at a time, each acknowledged once by every other CPU
+static SpinLock tlbShootdownLock;
+static volatile uint32_t tlbGeneration = 0;
+static volatile uint32_t nPendingTLBAcks = 0;
+
+extern "C"
+{
+    extern uint8_t APTrampolineStart[];
+    extern uint8_t APTrampolineParams[];
+    extern uint8_t APTrampolineEnd[];
+}
+
+// Filled in for each AP in turn, at the end of the copied trampoline
+struct TrampolineParams
+{
+    uint32_t pageDirectory;
+    uint32_t stack;
+    CPU* cpu;
+    void (*entry)(CPU* cpu);
+} __attribute__((packed));
+
+static void LoadCPUSegment()
+{
+    uint16_t selector = GDT_CPU_SELECTOR;
+    asm volatile("mov %0, %%fs" : : "r"(selector));
+}
+
+void InitBootCPU()
+{
+    // kernel_main has already built the GDT with an entry for us
+    CPU* cpu = &cpus[0];
+    cpu->pSelf = cpu;
+    cpu->id = 0;
+    cpu->pGDT = GDTTable;
+    cpu->bOnline = true;
+
+    LoadCPUSegment();
+}
+
+static void APMain(CPU* cpu)
+{
+    // Our own GDT, TSS and per-CPU data, but the same IDT
+    LoadGDT(cpu->pGDT, sizeof(GDTTable));
+    LoadTSS(GDT_TSS_SELECTOR);
+    LoadCPUSegment();
+    LoadInterruptTable();
+
+    EnableFPU();
+    EnableFastSyscalls();
+    EnableLocalAPIC();
+    StartLocalAPICTimer();
+
+    // Not counted in any shootdown started before now (see FlushOtherCPUsTLB)
+    cpu->tlbGeneration = tlbGeneration;
+    cpu->bOnline = true;
+
+    // Idle until the scheduler gives us something - like kernel_main
+    EnableInterrupts();
+    while (true) { asm("hlt"); }
+}
+
+static bool StartCPU(CPU* cpu, TrampolineParams* pParams)
+{
+    // Same as the BSP's GDT, but for the per-CPU entries
+    cpu->pGDT = (uint64_t*)kmalloc(sizeof(GDTTable));
+    memcpy(cpu->pGDT, GDTTable, sizeof(GDTTable));
+    cpu->tss = CreateTSSEntry(0, 0x10);
+    cpu->pGDT[GDT_TSS_ENTRY] = CreateGDTEntry((uint32_t)&cpu->tss, sizeof(TSS), TSS_PL0);
+    cpu->pGDT[GDT_CPU_ENTRY] = CreateGDTEntry((uint32_t)cpu, 0xFFFFF, GDT_DATA_PL0);
+
+    cpu->pPageDirectory = CreatePageDirectory(&cpu->pUserWindow);
+
+    pParams->pageDirectory = (uint32_t)cpu->pPageDirectory;
+    pParams->stack = (uint32_t)kmalloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
+    pParams->cpu = cpu;
+    pParams->entry = &APMain;
+
+    // INIT, then up to two startup IPIs as the MP spec asks
+    SendInitIPI(cpu->apicID);
+    LocalAPICDelay(10000);
+    for (int i = 0; i < 2 && !cpu->bOnline; ++i)
+    {
+        SendStartupIPI(cpu->apicID, TRAMPOLINE_ADDRESS >> 12);
+        LocalAPICDelay(200);
+    }
+
+    // Give it 100ms to get to APMain
+    for (int i = 0; i < 100 && !cpu->bOnline; ++i) LocalAPICDelay(1000);
+    return cpu->bOnline;
+}
+
+// Interrupts must be off
+static void AcknowledgeTLBFlush()
+{
+    CPU* cpu = GetCPU();
+    uint32_t generation = __atomic_load_n(&tlbGeneration, __ATOMIC_ACQUIRE);
+    if (cpu->tlbGeneration == generation) return;
+
+    FlushTLB();
+    cpu->tlbGeneration = generation;
+    __atomic_fetch_sub(&nPendingTLBAcks, 1, __ATOMIC_RELEASE);
+}
+
+void OnTLBFlushIPI()
+{
+    AcknowledgeTLBFlush();
+}
+
+void FlushOtherCPUsTLB()
+{
+    if (nCPUs == 1) return;
+
+    // Waiting with interrupts off, so another CPU's shootdown is acknowledged whilst we wait for ours
+    uint32_t flags = SaveAndDisableInterrupts();
+    while (__atomic_exchange_n(&tlbShootdownLock.bLocked, true, __ATOMIC_ACQUIRE))
+    {
+        AcknowledgeTLBFlush();
+        asm volatile("pause");
+    }
+
+    // Not done until none of them can still reach the freed frames through a stale entry
+    GetCPU()->tlbGeneration = tlbGeneration + 1;
+    __atomic_store_n(&nPendingTLBAcks, nCPUs - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&tlbGeneration, tlbGeneration + 1, __ATOMIC_RELEASE);
+    BroadcastIPI(APIC_TLB_FLUSH_VECTOR);
+    while (__atomic_load_n(&nPendingTLBAcks, __ATOMIC_ACQUIRE) != 0) asm volatile("pause");
+
+    ReleaseSpinLock(&tlbShootdownLock);
+    RestoreInterrupts(flags);
+}
+
+void InitSMP()
+{
+    // Every CPU maps user programs through its own page directory, BSP included
+    cpus[0].pPageDirectory = CreatePageDirectory(&cpus[0].pUserWindow);
+    LoadPageDirectories((uint32_t)cpus[0].pPageDirectory);
+
+    CPUTopology topology;
+    if (!GetCPUTopology(&topology))
+    {
+        VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
+        VGA_printf("No MADT found, running on one CPU");
+        return;
+    }
+
+    InitLocalAPIC(topology.localAPICAddress);
+    EnableLocalAPIC();
+    cpus[0].apicID = GetLocalAPICID();
+    CalibrateLocalAPICTimer();
+
+    memcpy((void*)TRAMPOLINE_ADDRESS, APTrampolineStart, (size_t)(APTrampolineEnd - APTrampolineStart));
+    TrampolineParams* pParams = (TrampolineParams*)(TRAMPOLINE_ADDRESS + (APTrampolineParams - APTrampolineStart));
+
+    for (uint32_t i = 0; i < topology.nCPUs && nCPUs < MAX_CPUS; ++i)
+    {
+        if (topology.apicIDs[i] == cpus[0].apicID) continue;
+
+        CPU* cpu = &cpus[nCPUs];
+        cpu->pSelf = cpu;
+        cpu->id = nCPUs;
+        cpu->apicID = topology.apicIDs[i];
+
+        if (StartCPU(cpu, pParams)) nCPUs++;
+        else
+        {
+            VGA_printf("[Failure] ", false, VGA_COLOUR_LIGHT_RED);
+            VGA_printf("CPU with APIC ID ", false);
+            VGA_printf(cpu->apicID, false);
+            VGA_printf(" didn't start");
+        }
+    }
+
+    VGA_printf("[Success] ", false, VGA_COLOUR_LIGHT_GREEN);
+    VGA_printf("Running on ", false);
+    VGA_printf(nCPUs, false);
+    VGA_printf(nCPUs == 1 ? " CPU" : " CPUs");
+}
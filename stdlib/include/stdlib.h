@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "task.h"
+
 #define assert(expr) \
     if (!(expr)) \
         error(__FILE__, __LINE__, #expr)
@@ -27,6 +29,15 @@ void    memcpy(void *dest, void *src, size_t n);
 
 void    error(const char* file, unsigned int line, const char* expression);
 
+int     createThread(void (*function)(void*), void* arg);
+void*   getThreadLocalStorage(void);
+
+TaskEventQueue* getEventQueue(void);
+int     pollEvents(TaskEvent* events, uint32_t maxEvents);
+
+int     ringSubmit(SyscallRing* ring, uint32_t syscall, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t userData);
+int     ringReap(SyscallRing* ring, CompletionEntry* completion);
+
 struct Registers
 {
     uint32_t esi;
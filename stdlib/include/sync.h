@@ -0,0 +1,52 @@
+#pragma once
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+// Spin this many times before sleeping on a futex, as locks are usually held only briefly
+#define SYNC_SPIN_COUNT 100
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// 0 if unlocked, 1 if locked, 2 if locked and someone may be sleeping on it
+typedef struct mutex_t
+{
+    uint32_t state;
+} Mutex;
+
+// Bumped on every signal, so a waiter can tell if it's missed one
+typedef struct condition_t
+{
+    uint32_t sequence;
+} Condition;
+
+typedef struct semaphore_t
+{
+    uint32_t count;
+    uint32_t nWaiters;
+} Semaphore;
+
+void    mutexInit(Mutex* mutex);
+void    mutexLock(Mutex* mutex);
+int     mutexTryLock(Mutex* mutex);
+void    mutexUnlock(Mutex* mutex);
+
+void    condInit(Condition* cond);
+void    condWait(Condition* cond, Mutex* mutex);
+void    condSignal(Condition* cond);
+void    condBroadcast(Condition* cond);
+
+void    semInit(Semaphore* sem, uint32_t count);
+void    semWait(Semaphore* sem);
+int     semTryWait(Semaphore* sem);
+void    semPost(Semaphore* sem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,29 +4,185 @@
 
 #include <stdint.h>
 
+#define MAX_TASK_EVENTS 64  // power of two, making TaskEventQueue 3136 bytes
+
+#define TLS_EVENT_QUEUE 1   // word of thread local storage pointing at the thread's own event queue
+#define TLS_SYSENTER 2      // ...and set if its syscalls may use SYSENTER rather than int 0x80
+
+#define SYSCALL_RING_ENTRIES 64     // submissions (and completions) a ring holds, power of two
+
+#define EVENT_INLINE_SIZE 32        // payload bytes carried in the event itself
+#define EVENT_MAX_GRANT 0x100000    // ...and at most this many granted alongside it
+
 #ifdef __cplusplus
 extern "C"
 {
-    struct TaskEvent // 42 bytes in total
+    // Payloads longer than EVENT_INLINE_SIZE are granted - the sender points grant
+    // at them, and the receiver is given its own copy there, to free when done
+    struct TaskEvent // 48 bytes in total
     {
         uint32_t source;    // 4 bytes
         uint32_t id;        // 4 bytes
-        uint8_t data[32];   // 32 bytes
+        uint32_t length;    // 4 bytes, of the payload, in data or the grant
+        uint32_t grant;     // 4 bytes, address of the payload if not inline
+        uint8_t data[EVENT_INLINE_SIZE]; // 32 bytes
+    } __attribute__((packed));
+
+    // Ring buffer with the kernel as its only producer and the task as its
+    // only consumer, which can read it directly (see pollEvents) or through
+    // syscalls. Head and tail count up forever, and are masked to index it.
+    struct TaskEventQueue
+    {
+        TaskEvent returnEventBuffer;
+        uint32_t head;          // next to pop, only written by the consumer
+        uint32_t tail;          // next to push, copied out by the kernel from its own
+        uint64_t removed;       // slots taken out of the middle (see popLastEvent), one bit each
+        TaskEvent events[MAX_TASK_EVENTS];
+    };
+
+    // Passed straight from one thread to another (see ipcCall)
+    struct IPCMessage
+    {
+        uint32_t data[8];
+    };
+
+    // A syscall, to be made the next time the task enters the kernel with ringEnter - those
+    // that wait or never return complete with -1 instead (see pNotInRings)
+    struct SubmissionEntry
+    {
+        uint32_t syscall;       // number, as in syscall.h
+        uint32_t args[3];       // in ebx, ecx and edx
+        uint32_t userData;      // handed back with its result
+    };
+
+    struct CompletionEntry
+    {
+        uint32_t userData;
+        int32_t result;
+    };
+
+    // Shared between a thread and the kernel (see ringSetup). Each queue has one
+    // producer and one consumer, and heads and tails count up forever, masked to index
+    struct SyscallRing
+    {
+        uint32_t submissionHead;    // next to make, only written by the kernel
+        uint32_t submissionTail;    // next to fill, only written by the task
+        uint32_t completionHead;    // next to reap, only written by the task
+        uint32_t completionTail;    // next to fill, only written by the kernel
+        SubmissionEntry submissions[SYSCALL_RING_ENTRIES];
+        CompletionEntry completions[SYSCALL_RING_ENTRIES];
+    };
+
+    struct TaskStats
+    {
+        uint32_t processID;
+        uint32_t mainThreadID;      // processID of the thread owning the process's memory
+        uint32_t parentID;
+        char sName[32];
+        uint32_t state;
+        uint32_t cpu;               // last ran on
+        uint64_t runCycles;         // TSC cycles spent running
+        uint64_t blockedCycles;     // ...and blocked
+        uint32_t nSwitches;
+        uint32_t nSyscalls;
+        uint32_t nPageFaults;
+        uint32_t nDeadlineMisses;
+        uint32_t nDroppedEvents;    // pushed to its queue when it was full
     } __attribute__((packed));
 }
 #else
-typedef struct taskEvent_t // 42 bytes in total
+typedef struct taskEvent_t // 48 bytes in total
 {
     uint32_t source;    // 4 bytes
     uint32_t id;        // 4 bytes
-    uint8_t data[32];   // 32 bytes
+    uint32_t length;    // 4 bytes, of the payload, in data or the grant
+    uint32_t grant;     // 4 bytes, address of the payload if not inline
+    uint8_t data[EVENT_INLINE_SIZE]; // 32 bytes
 } __attribute__((packed)) TaskEvent;
+
+typedef struct taskEventQueue_t
+{
+    TaskEvent returnEventBuffer;
+    uint32_t head;          // next to pop, only written by the consumer
+    uint32_t tail;          // next to push, only written by the kernel
+    uint64_t removed;       // slots taken out of the middle (see popLastEvent), one bit each
+    TaskEvent events[MAX_TASK_EVENTS];
+} TaskEventQueue;
+
+typedef struct ipcMessage_t
+{
+    uint32_t data[8];
+} IPCMessage;
+
+typedef struct submissionEntry_t
+{
+    uint32_t syscall;       // number, as in syscall.h
+    uint32_t args[3];       // in ebx, ecx and edx
+    uint32_t userData;      // handed back with its result
+} SubmissionEntry;
+
+typedef struct completionEntry_t
+{
+    uint32_t userData;
+    int32_t result;
+} CompletionEntry;
+
+typedef struct syscallRing_t
+{
+    uint32_t submissionHead;    // next to make, only written by the kernel
+    uint32_t submissionTail;    // next to fill, only written by the task
+    uint32_t completionHead;    // next to reap, only written by the task
+    uint32_t completionTail;    // next to fill, only written by the kernel
+    SubmissionEntry submissions[SYSCALL_RING_ENTRIES];
+    CompletionEntry completions[SYSCALL_RING_ENTRIES];
+} SyscallRing;
+
+typedef struct taskStats_t
+{
+    uint32_t processID;
+    uint32_t mainThreadID;      // processID of the thread owning the process's memory
+    uint32_t parentID;
+    char sName[32];
+    uint32_t state;
+    uint32_t cpu;               // last ran on
+    uint64_t runCycles;         // TSC cycles spent running
+    uint64_t blockedCycles;     // ...and blocked
+    uint32_t nSwitches;
+    uint32_t nSyscalls;
+    uint32_t nPageFaults;
+    uint32_t nDeadlineMisses;
+    uint32_t nDroppedEvents;    // pushed to its queue when it was full
+} __attribute__((packed)) TaskStats;
 #endif
 
-#define EVENT_QUEUE_PRINTF 0xdeadbeef
+// The kernel's own events, which are never crowded out of a queue by anyone else's - the
+// same ids pushed by a process are just ordinary events. Stdout is only queued once until
+// taken, however much more is written (see readStdout)
+#define EVENT_QUEUE_STDOUT 0xdeadbeef   // source has written to stdout (see readStdout)
 #define EVENT_QUEUE_SYSEXIT 0xefefefe
 #define EVENT_QUEUE_KEY_PRESS 0x1234321
 
+#define PIPE_STDIN          0           // pipe ends every process may have been given by its parent
+#define PIPE_STDOUT         1
+#define PIPE_NONE           0xFFFFFFFF
+
+#define WAIT_ANY_CHILD      0xFFFFFFFF
+#define WAIT_FOREVER        0xFFFFFFFF
+#define WAIT_TIMED_OUT      0           // (so events waited for by ID must be non-zero)
+#define MAX_WAIT_EVENTS     8           // IDs waitEvents can wait for at once
+#define TICKS_PER_SECOND    120         // what timeouts and periods are counted in
+
+#define FUTEX_WOKEN         0
+#define FUTEX_CHANGED       1           // from what was expected, so never slept
+#define FUTEX_TIMED_OUT     2
+
+#define EXIT_CODE_KILLED    -1
+
+#define TASK_STATE_READY    0
+#define TASK_STATE_RUNNING  1
+#define TASK_STATE_BLOCKED  2
+#define TASK_STATE_ZOMBIE   3
+
 #define KEY_EVENT_ALT   0x1
 #define KEY_EVENT_DOWN  0x2
 #define KEY_EVENT_UP    0x3
@@ -63,5 +63,80 @@ void error(const char* file, unsigned int line, const char* expression)
     printf(": assertion '");
     printf(expression);
     printf("' failed\n");
-    sysexit();
+    exit(1);
 }
+
+static void threadEntry(void (*function)(void*), void* arg)
+{
+    function(arg);
+    threadExit(0);
+}
+
+int createThread(void (*function)(void*), void* arg)
+{
+    return threadCreate((uint32_t)&threadEntry, (uint32_t)function, (uint32_t)arg);
+}
+
+void* getThreadLocalStorage(void)
+{
+    // First word of the block gs points at is its own address
+    void* pStorage;
+    asm volatile("mov %%gs:0, %0" : "=r" (pStorage));
+    return pStorage;
+}
+
+TaskEventQueue* getEventQueue(void)
+{
+    // The kernel leaves each thread's own in its thread local storage
+    TaskEventQueue* pQueue;
+    asm volatile("mov %%gs:%c1, %0" : "=r" (pQueue) : "i" (TLS_EVENT_QUEUE * 4));
+    return pQueue;
+}
+
+int pollEvents(TaskEvent* events, uint32_t maxEvents)
+{
+    // Consumes straight from the ring the kernel pushes to, without a syscall -
+    // only safe if the thread doesn't call this from two places at once
+    TaskEventQueue* pQueue = getEventQueue();
+    uint32_t head = pQueue->head;
+    uint32_t tail = __atomic_load_n(&pQueue->tail, __ATOMIC_ACQUIRE);
+
+    uint32_t nEvents = 0;
+    for (; head != tail && nEvents < maxEvents; ++head)
+    {
+        // Passing over (and freeing) any slots popLastEvent removed
+        uint32_t slot = head & (MAX_TASK_EVENTS - 1);
+        uint64_t bit = 1ull << slot;
+        if (pQueue->removed & bit) { pQueue->removed &= ~bit; continue; }
+        memcpy(&events[nEvents++], &pQueue->events[slot], sizeof(TaskEvent));
+    }
+
+    __atomic_store_n(&pQueue->head, head, __ATOMIC_RELEASE);
+    return (int)nEvents;
+}
+
+int ringSubmit(SyscallRing* ring, uint32_t syscall, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t userData)
+{
+    // Made the next time ringEnter is called, unless the kernel hasn't got through those before it
+    uint32_t tail = ring->submissionTail;
+    if (tail - __atomic_load_n(&ring->submissionHead, __ATOMIC_ACQUIRE) >= SYSCALL_RING_ENTRIES) return -1;
+
+    SubmissionEntry* entry = &ring->submissions[tail & (SYSCALL_RING_ENTRIES - 1)];
+    entry->syscall = syscall;
+    entry->args[0] = arg0;
+    entry->args[1] = arg1;
+    entry->args[2] = arg2;
+    entry->userData = userData;
+    __atomic_store_n(&ring->submissionTail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int ringReap(SyscallRing* ring, CompletionEntry* completion)
+{
+    uint32_t head = ring->completionHead;
+    if (head == __atomic_load_n(&ring->completionTail, __ATOMIC_ACQUIRE)) return -1;
+
+    memcpy(completion, &ring->completions[head & (SYSCALL_RING_ENTRIES - 1)], sizeof(CompletionEntry));
+    __atomic_store_n(&ring->completionHead, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
\ No newline at end of file
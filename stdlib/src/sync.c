@@ -0,0 +1,116 @@
+#include "sync.h"
+#include "interrupts/syscall.h"
+
+static inline void pause(void)
+{
+    asm volatile("pause");
+}
+
+static inline uint32_t compareAndSwap(uint32_t* pValue, uint32_t expected, uint32_t desired)
+{
+    // Returns what was there, which is expected if it worked
+    __atomic_compare_exchange_n(pValue, &expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return expected;
+}
+
+void mutexInit(Mutex* mutex)
+{
+    mutex->state = 0;
+}
+
+void mutexLock(Mutex* mutex)
+{
+    // Uncontended, or about to be let go of
+    uint32_t state = 0;
+    for (uint32_t i = 0; i < SYNC_SPIN_COUNT; ++i)
+    {
+        state = compareAndSwap(&mutex->state, 0, 1);
+        if (state == 0) return;
+        pause();
+    }
+
+    // Else mark it as having a sleeper, and sleep until it's unlocked
+    if (state != 2) state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    while (state != 0)
+    {
+        futexWait(&mutex->state, 2, WAIT_FOREVER);
+        state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+int mutexTryLock(Mutex* mutex)
+{
+    return compareAndSwap(&mutex->state, 0, 1) == 0 ? 0 : -1;
+}
+
+void mutexUnlock(Mutex* mutex)
+{
+    // Only a syscall if someone may be sleeping
+    if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2) futexWake(&mutex->state, 1);
+}
+
+void condInit(Condition* cond)
+{
+    cond->sequence = 0;
+}
+
+void condWait(Condition* cond, Mutex* mutex)
+{
+    // A signal between unlocking and sleeping changes the sequence, so we won't sleep through it
+    uint32_t sequence = __atomic_load_n(&cond->sequence, __ATOMIC_ACQUIRE);
+    mutexUnlock(mutex);
+    futexWait(&cond->sequence, sequence, WAIT_FOREVER);
+
+    // Others may have been woken with us, so take the mutex as if there are sleepers
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) futexWait(&mutex->state, 2, WAIT_FOREVER);
+}
+
+void condSignal(Condition* cond)
+{
+    __atomic_fetch_add(&cond->sequence, 1, __ATOMIC_RELEASE);
+    futexWake(&cond->sequence, 1);
+}
+
+void condBroadcast(Condition* cond)
+{
+    __atomic_fetch_add(&cond->sequence, 1, __ATOMIC_RELEASE);
+    futexWake(&cond->sequence, 0xFFFFFFFF);
+}
+
+void semInit(Semaphore* sem, uint32_t count)
+{
+    sem->count = count;
+    sem->nWaiters = 0;
+}
+
+int semTryWait(Semaphore* sem)
+{
+    uint32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+    while (count > 0)
+    {
+        uint32_t found = compareAndSwap(&sem->count, count, count - 1);
+        if (found == count) return 0;
+        count = found;
+    }
+    return -1;
+}
+
+void semWait(Semaphore* sem)
+{
+    for (uint32_t i = 0; i < SYNC_SPIN_COUNT; ++i)
+    {
+        if (semTryWait(sem) == 0) return;
+        pause();
+    }
+
+    // Counted as a waiter first, so semPost knows to wake us
+    __atomic_fetch_add(&sem->nWaiters, 1, __ATOMIC_ACQUIRE);
+    while (semTryWait(sem) != 0) futexWait(&sem->count, 0, WAIT_FOREVER);
+    __atomic_fetch_sub(&sem->nWaiters, 1, __ATOMIC_RELEASE);
+}
+
+void semPost(Semaphore* sem)
+{
+    __atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&sem->nWaiters, __ATOMIC_ACQUIRE) > 0) futexWake(&sem->count, 1);
+}
@@ -37,20 +37,33 @@ size_t nCharacter = 0;
 size_t nVisualCharacter = 0;
 size_t nVisualRow = 0;
 
-// Running commands
+// Events
+TaskEvent events[16];
+char stdoutBuffer[1024];
+
+// Running commands, as a pipeline of up to maxStages programs
+constexpr uint32_t maxStages = 4;
 bool bInCommand = false;
-uint32_t pid;
+uint32_t pids[maxStages];
+uint32_t nStages = 0;
+uint32_t nRunning = 0;
+constexpr uint32_t childCPUQuota = 9;   // ticks (1/120th of a second)...
+constexpr uint32_t childCPUPeriod = 12; // ...out of every 100ms
 
 // Recieving and handling commands
 void HandleSpecialKeys(char character);
 void HandleRegularKeys(char character);
 void OnCommand();
 void OnCommandFinish();
+uint32_t RunPipeline(char* command);
+char* TrimSpaces(char* text);
 void DrawPrompt();
+void DrawOutput(const char* message, size_t len);
 
 // Top bar
 constexpr uint32_t barPadding = 2;
 constexpr uint32_t barHeight = CHAR_HEIGHT*2 + barPadding*2;
+constexpr uint32_t topBarRefreshTicks = TICKS_PER_SECOND / 10;
 void DrawTopBar();
 
 int main()
@@ -61,6 +74,9 @@ int main()
     subscribeToKeyboard(true);
     printf("Starting window manager...\n");
 
+    // Commands get at most 3/4 of the CPU time, so a runaway one can't starve us
+    setChildCPUQuota(childCPUQuota, childCPUPeriod);
+
     // Screen dimensions and adress
     nWidth = getFramebufferWidth(); nHeight = getFramebufferHeight();
     nRows = (nHeight-nBorder*2) / (CHAR_HEIGHT*CHAR_SCALE) - 1; nColumns = (nWidth-nBorder*2) / CHAR_WIDTH;
@@ -73,10 +89,15 @@ int main()
 
     while(1)
     {
-        // Deal with events
-        TaskEvent* event = getNextEvent();
-        while (event != nullptr)
+        // Sleep until there's something to do, or the top bar's due a refresh
+        waitEvents(nullptr, 0, topBarRefreshTicks);
+
+        // Deal with events, a batch at a time, straight out of our queue
+        int nEvents = pollEvents(events, sizeof(events) / sizeof(events[0]));
+        for (int e = 0; e < nEvents; ++e)
         {
+            TaskEvent* event = &events[e];
+
             // Key input
             if (event->id == EVENT_QUEUE_KEY_PRESS)
             {
@@ -89,44 +110,32 @@ int main()
                 else if (!bInCommand && nCharacter < sizeof(textBuffer) / sizeof(textBuffer[0]) - 1) HandleRegularKeys(character);
             }
 
-            // Stdout
-            if (event->id == EVENT_QUEUE_PRINTF && bInCommand)
+            // Stdout - read it all, even when not in a command, or the writer will block
+            if (event->id == EVENT_QUEUE_STDOUT)
             {
-                const char* message = (const char*)event->data;
-                size_t len = strlen(message);
-                for (size_t i = 0; i < len; ++i)
+                int len;
+                while ((len = readStdout(event->source, stdoutBuffer, sizeof(stdoutBuffer))) > 0)
                 {
-                    if (message[i] == '\n') { nVisualRow++; nVisualCharacter = 0; }
-                    else
-                    {
-                        DrawChar(message[i], false);
-                        nVisualCharacter++;
-
-                        if (nVisualCharacter >= nColumns)
-                        {
-                            nVisualCharacter = 0;
-                            nVisualRow++;
-                        }
-                    }
-
-                    if (nVisualRow >= nRows)
-                    {
-                        nVisualRow = 0;
-                        ClearScreen();
-                    }
+                    if (bInCommand) DrawOutput(stdoutBuffer, (size_t)len);
                 }
             }
 
-            // Sysexits
-            if (event->id == EVENT_QUEUE_SYSEXIT) OnCommandFinish();
+            // Sysexits - collect our own children, or they'd be left as zombies
+            if (event->id == EVENT_QUEUE_SYSEXIT)
+            {
+                wait(event->source, nullptr);
 
-            event = getNextEvent();
+                // Done once every stage of the command is
+                for (uint32_t i = 0; i < nStages; ++i)
+                {
+                    if (pids[i] != event->source) continue;
+                    pids[i] = (uint32_t)-1;
+                    if (--nRunning == 0) OnCommandFinish();
+                }
+            }
         }
         
         DrawTopBar();
-
-        // We *must not* block, as if both processes block, we'll be in drouble trouble!
-        //block();
     }
 
     sysexit();
@@ -213,7 +222,12 @@ void HandleSpecialKeys(char character)
 
     if (character == KEY_EVENT_CTRL && bInCommand) // Force quit
     {
-        kill(pid);
+        for (uint32_t i = 0; i < nStages; ++i)
+        {
+            if ((int32_t)pids[i] != -1) kill(pids[i]);
+        }
+        nStages = 0;
+        nRunning = 0;
         OnCommandFinish();
     }
 }
@@ -254,8 +268,8 @@ void OnCommand()
     bInCommand = true;
 
     // Get command
-    pid = loadProgram(textBuffer);
-    if ((int32_t)pid == -1)
+    nRunning = RunPipeline(textBuffer);
+    if (nRunning == 0)
     {
         /*
             const char* errorMessage = "Unknown command";
@@ -301,6 +315,31 @@ void DrawPrompt()
     memset(textBuffer, '\0', sizeof(textBuffer)/sizeof(textBuffer[0]));
 }
 
+void DrawOutput(const char* message, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (message[i] == '\n') { nVisualRow++; nVisualCharacter = 0; }
+        else
+        {
+            DrawChar(message[i], false);
+            nVisualCharacter++;
+
+            if (nVisualCharacter >= nColumns)
+            {
+                nVisualCharacter = 0;
+                nVisualRow++;
+            }
+        }
+
+        if (nVisualRow >= nRows)
+        {
+            nVisualRow = 0;
+            ClearScreen();
+        }
+    }
+}
+
 void DrawTopBar()
 {
     uint32_t x = barPadding + nBorder;
@@ -327,3 +366,44 @@ void DrawTopBar()
     PrintString(sSource1); x += CHAR_WIDTH*strlen(sSource1);
     PrintString(__FILE__); x += CHAR_WIDTH*strlen(__FILE__);
 }
+
+char* TrimSpaces(char* text)
+{
+    while (*text == ' ') text++;
+    size_t len = strlen(text);
+    while (len > 0 && text[len - 1] == ' ') text[--len] = '\0';
+    return text;
+}
+
+uint32_t RunPipeline(char* command)
+{
+    // Split "a | b | c" into stages
+    char* stages[maxStages];
+    nStages = 0;
+    stages[nStages++] = command;
+    for (char* c = command; *c != '\0'; ++c)
+    {
+        if (*c != '|' || nStages == maxStages) continue;
+        *c = '\0';
+        stages[nStages++] = c + 1;
+    }
+
+    // Run them all at once, each one's stdout piped into the next one's stdin
+    uint32_t nStarted = 0;
+    uint32_t stdinEnd = PIPE_NONE;
+    for (uint32_t i = 0; i < nStages; ++i)
+    {
+        uint32_t ends[2] = { PIPE_NONE, PIPE_NONE };
+        if (i < nStages - 1 && pipe(ends) != 0) ends[0] = ends[1] = PIPE_NONE;
+
+        pids[i] = (uint32_t)loadProgramWithPipes(TrimSpaces(stages[i]), stdinEnd, ends[1]);
+        if ((int32_t)pids[i] != -1) nStarted++;
+
+        // The children have their own ends now
+        if (stdinEnd != PIPE_NONE) pipeClose(stdinEnd);
+        if (ends[1] != PIPE_NONE) pipeClose(ends[1]);
+        stdinEnd = ends[0];
+    }
+
+    return nStarted;
+}
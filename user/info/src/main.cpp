@@ -64,7 +64,7 @@ void PrintGDT()
     buffer = (char*)malloc(4096);
 
     // Get GDT info
-    uint64_t gdtEntries[6];
+    uint64_t gdtEntries[8];
     getGDT(&gdtEntries);
 
     Print("Base");
@@ -1,25 +1,51 @@
 #include "interrupts/syscall.h"
 #include "stdlib.h"
+#include "file.h"
 #include "file/filedefs.h"
 
 int main();
 
+// Made through the ring, so by number (see syscall.h)
+constexpr uint32_t getFileNameSyscall = 12;
+
 int main()
 {
-    char* filenameBuffer = (char*) malloc(1024);
+    // Each handle only comes from the one before, but their names can all be
+    // fetched in one trip into the kernel, and printed in another
+    SyscallRing* pRing = ringSetup();
+    char* filenameBuffer = (char*) malloc(SYSCALL_RING_ENTRIES * MAX_FILE_NAME_LENGTH);
+    char* outputBuffer = (char*) malloc(SYSCALL_RING_ENTRIES * (MAX_FILE_NAME_LENGTH + 5));
+
     FileHandle file = getFirstFile();
     while ((signed int)file != -1)
     {
-        getFileName(file, filenameBuffer);
-        
-        printf("--- ");
-        printf(filenameBuffer);
-        printf("\n");
+        uint32_t nFiles = 0;
+        while ((signed int)file != -1 && nFiles < SYSCALL_RING_ENTRIES)
+        {
+            ringSubmit(pRing, getFileNameSyscall, file, (uint32_t)&filenameBuffer[nFiles * MAX_FILE_NAME_LENGTH], 0, nFiles);
+            nFiles++;
+            file = getNextFile(file);
+        }
+        ringEnter();
+
+        // Completions come back in order, but go by what they were submitted with anyway
+        uint32_t length = 0;
+        CompletionEntry completion;
+        while (ringReap(pRing, &completion) == 0)
+        {
+            if (completion.result != 0) continue;
+            const char* sName = &filenameBuffer[completion.userData * MAX_FILE_NAME_LENGTH];
 
-        file = getNextFile(file);
+            memcpy(&outputBuffer[length], (void*)"--- ", 4);
+            length += 4;
+            for (uint32_t i = 0; i < MAX_FILE_NAME_LENGTH && sName[i] != '\0'; ++i) outputBuffer[length++] = sName[i];
+            outputBuffer[length++] = '\n';
+        }
+        writeStdout(outputBuffer, length);
     }
 
-    free(filenameBuffer, 1024);
+    free(outputBuffer, SYSCALL_RING_ENTRIES * (MAX_FILE_NAME_LENGTH + 5));
+    free(filenameBuffer, SYSCALL_RING_ENTRIES * MAX_FILE_NAME_LENGTH);
 
     sysexit();
     return 0;
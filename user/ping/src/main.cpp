@@ -0,0 +1,68 @@
+#include "interrupts/syscall.h"
+#include "stdlib.h"
+
+int main();
+
+#define N_ROUND_TRIPS 1000
+
+// Functions
+uint64_t ReadTimestampCounter();
+void Server(void* arg);
+
+int main()
+{
+    // Echoes back whatever it's sent, from another thread of ours
+    int serverID = createThread(&Server, nullptr);
+    if (serverID < 0)
+    {
+        printf("Couldn't start server\n");
+        sysexit();
+    }
+
+    // Time calls to it - each one hands off to the server and straight back
+    IPCMessage message;
+    uint64_t start = ReadTimestampCounter();
+    for (uint32_t i = 1; i <= N_ROUND_TRIPS; ++i)
+    {
+        message.data[0] = i;
+        if (ipcCall((uint32_t)serverID, &message) != 0 || message.data[0] != i + 1)
+        {
+            printf("Round trip failed\n");
+            break;
+        }
+    }
+    uint64_t cycles = ReadTimestampCounter() - start;
+
+    // ...then tell it to stop
+    message.data[0] = 0;
+    ipcCall((uint32_t)serverID, &message);
+    threadJoin((uint32_t)serverID);
+
+    printf("Cycles per round trip: ");
+    printn((uint32_t)(cycles / N_ROUND_TRIPS), false);
+    printf("\n");
+
+    sysexit();
+    return 0;
+}
+
+uint64_t ReadTimestampCounter()
+{
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+void Server(void* arg __attribute__((unused)))
+{
+    // Replying to one client and waiting for the next in one go
+    IPCMessage message;
+    int client = ipcReceive(&message);
+    while (client > 0 && message.data[0] != 0)
+    {
+        message.data[0]++;
+        client = ipcReplyReceive((uint32_t)client, &message);
+    }
+
+    if (client > 0) ipcReply((uint32_t)client, &message);
+}
@@ -0,0 +1,149 @@
+#include "interrupts/syscall.h"
+#include "stdlib.h"
+
+int main();
+
+#define MAX_TASKS 64
+
+// Buffer
+char* buffer;
+uint32_t bufferCounter = 0;
+
+// Printing utils
+void Print(const char* string);
+void Printn(const uint32_t data, const uint32_t width);
+
+void Print(const char* string)
+{
+    for (size_t i = 0; i < strlen(string); ++i) buffer[bufferCounter++] = string[i];
+    buffer[bufferCounter] = '\0';
+}
+
+void Printn(const uint32_t data, const uint32_t width)
+{
+    // Decimal, right aligned to width
+    char digits[10];
+    uint32_t nDigits = 0;
+    uint32_t i = data;
+    do { digits[nDigits++] = (char)('0' + i % 10); } while (i /= 10);
+
+    for (uint32_t d = nDigits; d < width; ++d) Print(" ");
+    while (nDigits > 0) buffer[bufferCounter++] = digits[--nDigits];
+    buffer[bufferCounter] = '\0';
+}
+
+// Functions
+uint64_t ReadTimestampCounter();
+TaskStats* FindTask(TaskStats* pStats, uint32_t nStats, uint32_t processID);
+void PrintProcesses(TaskStats* pPrevious, uint32_t nPrevious, TaskStats* pCurrent, uint32_t nCurrent, uint64_t elapsed);
+
+int main()
+{
+    buffer = (char*)malloc(8192);
+    TaskStats* pPrevious = (TaskStats*)malloc(sizeof(TaskStats) * MAX_TASKS);
+    TaskStats* pCurrent = (TaskStats*)malloc(sizeof(TaskStats) * MAX_TASKS);
+
+    int nPrevious = getTaskStats(pPrevious, MAX_TASKS);
+    uint64_t previousTime = ReadTimestampCounter();
+
+    // Runs until killed
+    while (nPrevious >= 0)
+    {
+        // Asleep in between, so as not to show up as busy ourselves - waking
+        // early for anything pushed to us, which we've no use for
+        while (waitEvents(nullptr, 0, TICKS_PER_SECOND) != WAIT_TIMED_OUT) getNextEvent();
+
+        int nCurrent = getTaskStats(pCurrent, MAX_TASKS);
+        uint64_t currentTime = ReadTimestampCounter();
+        if (nCurrent < 0) break;
+
+        PrintProcesses(pPrevious, (uint32_t)nPrevious, pCurrent, (uint32_t)nCurrent, currentTime - previousTime);
+
+        // This sample is the next one's baseline
+        TaskStats* pTemp = pPrevious;
+        pPrevious = pCurrent;
+        pCurrent = pTemp;
+        nPrevious = nCurrent;
+        previousTime = currentTime;
+    }
+
+    free(pCurrent, sizeof(TaskStats) * MAX_TASKS);
+    free(pPrevious, sizeof(TaskStats) * MAX_TASKS);
+    free(buffer, 8192);
+
+    sysexit();
+    return 0;
+}
+
+uint64_t ReadTimestampCounter()
+{
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+TaskStats* FindTask(TaskStats* pStats, uint32_t nStats, uint32_t processID)
+{
+    for (uint32_t i = 0; i < nStats; ++i)
+    {
+        if (pStats[i].processID == processID) return &pStats[i];
+    }
+    return nullptr;
+}
+
+void PrintProcesses(TaskStats* pPrevious, uint32_t nPrevious, TaskStats* pCurrent, uint32_t nCurrent, uint64_t elapsed)
+{
+    if (elapsed == 0) elapsed = 1;
+
+    bufferCounter = 0;
+    Print("\n  PID  CPU%  WAIT%  SWITCH  SYSCALL  FAULT  MISS  DROP  NAME\n");
+
+    for (uint32_t i = 0; i < nCurrent; ++i)
+    {
+        // One line per process, adding up all of its threads over the last sample
+        TaskStats* process = &pCurrent[i];
+        if (process->processID != process->mainThreadID) continue;
+
+        uint64_t runCycles = 0;
+        uint64_t blockedCycles = 0;
+        uint32_t nSwitches = 0;
+        uint32_t nSyscalls = 0;
+        uint32_t nPageFaults = 0;
+        uint32_t nDeadlineMisses = 0;
+        uint32_t nDroppedEvents = 0;
+        for (uint32_t j = 0; j < nCurrent; ++j)
+        {
+            TaskStats* thread = &pCurrent[j];
+            if (thread->mainThreadID != process->processID) continue;
+
+            // New since the last sample, so counts from zero
+            TaskStats* before = FindTask(pPrevious, nPrevious, thread->processID);
+            runCycles += thread->runCycles - (before == nullptr ? 0 : before->runCycles);
+            blockedCycles += thread->blockedCycles - (before == nullptr ? 0 : before->blockedCycles);
+            nSwitches += thread->nSwitches - (before == nullptr ? 0 : before->nSwitches);
+            nSyscalls += thread->nSyscalls - (before == nullptr ? 0 : before->nSyscalls);
+            nPageFaults += thread->nPageFaults - (before == nullptr ? 0 : before->nPageFaults);
+            nDeadlineMisses += thread->nDeadlineMisses - (before == nullptr ? 0 : before->nDeadlineMisses);
+            nDroppedEvents += thread->nDroppedEvents - (before == nullptr ? 0 : before->nDroppedEvents);
+        }
+
+        // Names fill all 32 bytes if long enough
+        char sName[sizeof(process->sName) + 1];
+        memcpy(sName, process->sName, sizeof(process->sName));
+        sName[sizeof(process->sName)] = '\0';
+
+        Printn(process->processID, 5);
+        Printn((uint32_t)(runCycles * 100 / elapsed), 6);
+        Printn((uint32_t)(blockedCycles * 100 / elapsed), 7);
+        Printn(nSwitches, 8);
+        Printn(nSyscalls, 9);
+        Printn(nPageFaults, 7);
+        Printn(nDeadlineMisses, 6);
+        Printn(nDroppedEvents, 6);
+        Print("  ");
+        Print(sName);
+        Print("\n");
+    }
+
+    printf(buffer);
+}
@@ -0,0 +1,39 @@
+#include "interrupts/syscall.h"
+#include "stdlib.h"
+
+int main();
+
+char buffer[1024];
+
+int main()
+{
+    // Counts whatever's piped into us, e.g. "ls | wc"
+    uint32_t nLines = 0;
+    uint32_t nWords = 0;
+    uint32_t nBytes = 0;
+    bool bInWord = false;
+
+    int len;
+    while ((len = pipeRead(PIPE_STDIN, buffer, sizeof(buffer))) > 0)
+    {
+        for (int i = 0; i < len; ++i)
+        {
+            const char c = buffer[i];
+            const bool bSpace = c == ' ' || c == '\n' || c == '\t';
+            if (c == '\n') nLines++;
+            if (!bSpace && !bInWord) nWords++;
+            bInWord = !bSpace;
+        }
+        nBytes += (uint32_t)len;
+    }
+
+    printn(nLines, false);
+    printf(" ");
+    printn(nWords, false);
+    printf(" ");
+    printn(nBytes, false);
+    printf("\n");
+
+    sysexit();
+    return 0;
+}